@@ -12,6 +12,12 @@
 #define CPUID_GET_FEATURES 0x1
 #define CPUID_GET_EXTENDED_INFO 0x80000000
 
+/* CPUID.01h:EDX feature bits */
+#define CPUID_FEAT_EDX_PSE (1U << 3)	/* 4 MiB pages */
+#define CPUID_FEAT_EDX_PGE (1U << 13)	/* global pages */
+#define CPUID_FEAT_EDX_PAT (1U << 16)	/* page attribute table */
+#define CPUID_FEAT_EDX_CLFSH (1U << 19)	/* CLFLUSH, line size in EBX */
+
 typedef struct {
 	char vendor[13];	/* vendor string (12 bytes + NUL) */
 } cpuid_vendor_t;
@@ -34,5 +40,9 @@ kernel_status_t cpuid_get_vendor(cpuid_vendor_t *vendor);
 kernel_status_t cpuid_get_features(cpuid_features_t *features);
 kernel_status_t cpuid_get_extended(cpuid_extended_t *extended);
 bool cpuid_is_supported(void);
+/* True if every CPUID_FEAT_EDX_* bit in mask is reported by leaf 1 */
+bool cpuid_has_feature_edx(u32 mask);
+/* Cache line size in bytes as reported by leaf 1, 0 if unknown */
+u32 cpuid_cache_line_size(void);
 
 #endif /* ARCH_I386_CPUID_H */
\ No newline at end of file
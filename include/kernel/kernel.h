@@ -41,6 +41,7 @@ typedef enum {
 /* Alignment helpers */
 #define ALIGN_UP(addr, align) (((addr) + (align) - 1) & ~((align) - 1))
 #define ALIGN_DOWN(addr, align) ((addr) & ~((align) - 1))
+#define PAGE_SHIFT 12
 #define PAGE_SIZE 4096
 #define PAGE_ALIGN(addr) ALIGN_UP(addr, PAGE_SIZE)
 
@@ -58,6 +59,17 @@ typedef enum {
 #define cli() __asm__ volatile("cli")
 #define cpu_relax() __asm__ volatile("rep; nop");
 
+/*
+ * Processor numbering. The kernel runs on the boot CPU only; per-CPU data
+ * is still indexed by smp_processor_id() so it is in place for SMP.
+ */
+#define NR_CPUS 1
+
+static inline u32 smp_processor_id(void)
+{
+	return 0;
+}
+
 /*
  * I/O port access helpers. These are small wrappers around inline asm
  * to perform byte/word/dword I/O on the legacy x86 ports.
@@ -101,6 +113,35 @@ static inline u32 inl(u16 port)
 	return ret;
 }
 
+/*
+ * Time stamp counter and model specific register access.
+ */
+static inline u64 rdtsc(void)
+{
+	u32 lo, hi;
+
+	__asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((u64)hi << 32) | lo;
+}
+
+static inline u64 rdmsr(u32 msr)
+{
+	u32 lo, hi;
+
+	__asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+	return ((u64)hi << 32) | lo;
+}
+
+static inline void wrmsr(u32 msr, u64 val)
+{
+	__asm__ volatile("wrmsr"
+			 :
+			 : "c"(msr), "a"((u32)val), "d"((u32)(val >> 32)));
+}
+
+/* Background work done while the CPU has nothing else to do. */
+void kernel_idle(void);
+
 /* Panic path - should not return. */
 void kernel_panic(const char *message) __attribute__((noreturn));
 
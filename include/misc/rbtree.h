@@ -0,0 +1,150 @@
+#ifndef MISC_RBTREE_H
+#define MISC_RBTREE_H
+
+#include <kernel/kernel.h>
+#include <misc/list.h>
+#include <stddef.h>
+
+/*
+ * Intrusive red-black tree.
+ *
+ * struct rb_node is embedded in the containing object, like list_head. The
+ * tree does no comparisons itself: callers walk down from root->rb_node to
+ * find the insertion point, link the node with rb_link_node() and then call
+ * rb_insert_color() to rebalance.
+ *
+ * The parent pointer and the node colour share one word; nodes are at
+ * least 4-byte aligned, so the low bit holds the colour.
+ *
+ * Augmented trees keep a per-node value computed from the node and its
+ * subtrees (e.g. the largest free range below a node). The tree calls back
+ * into struct rb_augment_callbacks whenever a rotation or an erase changes
+ * a subtree. RB_DECLARE_CALLBACKS_MAX() generates the callbacks for the
+ * common "maximum over the subtree" case.
+ */
+struct rb_node {
+	unsigned long __rb_parent_color;
+	struct rb_node *rb_right;
+	struct rb_node *rb_left;
+} __attribute__((aligned(sizeof(long))));
+
+struct rb_root {
+	struct rb_node *rb_node;
+};
+
+#define RB_ROOT ((struct rb_root){NULL})
+
+#define rb_parent(r) ((struct rb_node *)((r)->__rb_parent_color & ~3UL))
+#define rb_entry(ptr, type, member) container_of(ptr, type, member)
+#define rb_entry_safe(ptr, type, member) \
+	((ptr) ? rb_entry(ptr, type, member) : NULL)
+
+#define RB_EMPTY_ROOT(root) ((root)->rb_node == NULL)
+/* a node that is not in any tree points to itself */
+#define RB_EMPTY_NODE(node) \
+	((node)->__rb_parent_color == (unsigned long)(node))
+#define RB_CLEAR_NODE(node) \
+	((node)->__rb_parent_color = (unsigned long)(node))
+
+/* Hook node into the tree at *rb_link below parent (a red leaf) */
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent,
+				struct rb_node **rb_link)
+{
+	node->__rb_parent_color = (unsigned long)parent;
+	node->rb_left = node->rb_right = NULL;
+	*rb_link = node;
+}
+
+/* Rebalance after rb_link_node() */
+void rb_insert_color(struct rb_node *node, struct rb_root *root);
+/* Unlink node and rebalance */
+void rb_erase(struct rb_node *node, struct rb_root *root);
+
+/* In-order traversal, NULL at either end */
+struct rb_node *rb_first(const struct rb_root *root);
+struct rb_node *rb_last(const struct rb_root *root);
+struct rb_node *rb_next(const struct rb_node *node);
+struct rb_node *rb_prev(const struct rb_node *node);
+
+/*
+ * Augmented tree callbacks:
+ *   propagate - recompute the value from node up to (not including) stop
+ *   copy      - new takes over old's position, copy the value
+ *   rotate    - new replaced old as the subtree root, copy old's value to
+ *               new and recompute old
+ */
+struct rb_augment_callbacks {
+	void (*propagate)(struct rb_node *node, struct rb_node *stop);
+	void (*copy)(struct rb_node *old, struct rb_node *new);
+	void (*rotate)(struct rb_node *old, struct rb_node *new);
+};
+
+/* rb_insert_color() for augmented trees. The caller must already have
+ * updated the values on the path from the root down to the new node.
+ */
+void rb_insert_augmented(struct rb_node *node, struct rb_root *root,
+			 const struct rb_augment_callbacks *augment);
+/* rb_erase() for augmented trees */
+void rb_erase_augmented(struct rb_node *node, struct rb_root *root,
+			const struct rb_augment_callbacks *augment);
+
+/*
+ * Declare callbacks rbname for a tree of rbstruct linked through rbfield,
+ * where rbaugmented (of type rbtype) caches the maximum of rbcompute(node)
+ * over the node's subtree.
+ */
+#define RB_DECLARE_CALLBACKS_MAX(rbstatic, rbname, rbstruct, rbfield,        \
+				 rbtype, rbaugmented, rbcompute)             \
+	static inline bool rbname##_compute_max(rbstruct *node, bool exit)   \
+	{                                                                    \
+		rbstruct *child;                                             \
+		rbtype max = rbcompute(node);                                \
+		if (node->rbfield.rb_left) {                                 \
+			child = rb_entry(node->rbfield.rb_left, rbstruct,    \
+					 rbfield);                           \
+			if (child->rbaugmented > max)                        \
+				max = child->rbaugmented;                    \
+		}                                                            \
+		if (node->rbfield.rb_right) {                                \
+			child = rb_entry(node->rbfield.rb_right, rbstruct,   \
+					 rbfield);                           \
+			if (child->rbaugmented > max)                        \
+				max = child->rbaugmented;                    \
+		}                                                            \
+		if (exit && node->rbaugmented == max)                        \
+			return true;                                         \
+		node->rbaugmented = max;                                     \
+		return false;                                                \
+	}                                                                    \
+	static void rbname##_propagate(struct rb_node *rb,                   \
+				       struct rb_node *stop)                 \
+	{                                                                    \
+		while (rb != stop) {                                         \
+			rbstruct *node = rb_entry(rb, rbstruct, rbfield);    \
+			if (rbname##_compute_max(node, true))                \
+				break;                                       \
+			rb = rb_parent(&node->rbfield);                      \
+		}                                                            \
+	}                                                                    \
+	static void rbname##_copy(struct rb_node *rb_old,                    \
+				  struct rb_node *rb_new)                    \
+	{                                                                    \
+		rbstruct *old = rb_entry(rb_old, rbstruct, rbfield);         \
+		rbstruct *new = rb_entry(rb_new, rbstruct, rbfield);         \
+		new->rbaugmented = old->rbaugmented;                         \
+	}                                                                    \
+	static void rbname##_rotate(struct rb_node *rb_old,                  \
+				    struct rb_node *rb_new)                  \
+	{                                                                    \
+		rbstruct *old = rb_entry(rb_old, rbstruct, rbfield);         \
+		rbstruct *new = rb_entry(rb_new, rbstruct, rbfield);         \
+		new->rbaugmented = old->rbaugmented;                         \
+		rbname##_compute_max(old, false);                            \
+	}                                                                    \
+	rbstatic const struct rb_augment_callbacks rbname = {                \
+		.propagate = rbname##_propagate,                             \
+		.copy = rbname##_copy,                                       \
+		.rotate = rbname##_rotate,                                   \
+	};
+
+#endif /* MISC_RBTREE_H */
@@ -3,28 +3,80 @@
 
 #include <arch/i386/multiboot.h>
 #include <kernel/kernel.h>
+#include <mm/buddy.h>
 
 /*
- * Simple physical memory bitmap allocator representation and API.
- * g_physical_allocator holds global allocator metadata.
+ * Physical memory manager state.
+ *
+ * Allocation is done by the buddy allocator (see mm/buddy.h). 'bits' keeps
+ * one bit per page (set = allocated) as a shadow of the buddy state that is
+ * cross-checked on every allocation and free.
+ *
+ * The bitmap and the page database (mem_map) live in the metadata region
+ * [meta_start, meta_start + meta_size), which is identity mapped by the VMM.
+ *
+ * Free memory is watched against three watermarks (in pages):
+ *   min  - ordinary allocations fail rather than go below it; the pages
+ *          under it are kept for PMM_ALLOC_RESERVE (page tables)
+ *   low  - going below it wakes up reclaim (mm/shrinker.h)
+ *   high - background reclaim stops once free memory is back above it
  */
 typedef struct {
-	u8 *bits;		/* bitmap bit array */
-	u32 size;		/* size of bitmap in bytes */
+	u32 *bits;		/* bitmap words */
+	u32 words;		/* number of bitmap words */
+	u32 meta_start;		/* physical start of PMM metadata */
+	u32 meta_size;		/* size of PMM metadata in bytes */
 	u32 total_pages;	/* total managed pages */
 	u32 free_pages;		/* free pages available */
 	u32 used_pages;		/* used pages */
+	u32 wmark_min;		/* watermarks, in pages */
+	u32 wmark_low;
+	u32 wmark_high;
+	u32 wmark_failures;	/* allocations refused at the min watermark */
 } bitmap_allocator_t;
 
 extern bitmap_allocator_t g_physical_allocator;
 
+/*
+ * Zone selection flags for the allocation calls. With no flag the request
+ * is served from ZONE_NORMAL and falls back to ZONE_DMA. PMM_ZONE_HIGH is
+ * for memory that is only ever accessed through explicit mappings (heap,
+ * slabs, anonymous memory) and tries HIGH, NORMAL, then DMA. PMM_ZONE_DMA
+ * restricts the request to frames below 16 MiB.
+ */
+#define PMM_ZONE_NORMAL 0u
+#define PMM_ZONE_DMA (1u << 0)
+#define PMM_ZONE_HIGH (1u << 1)
+/* May use the pages below the min watermark */
+#define PMM_ALLOC_RESERVE (1u << 2)
+
 /* Physical memory manager (PMM) API */
 kernel_status_t pmm_init(multiboot_info_t *mb_info);
-u32 pmm_alloc_page(void);
+u32 pmm_alloc_page(u32 flags);
 void pmm_free_page(u32 addr);
 u32 pmm_get_total_pages(void);
 u32 pmm_get_free_pages(void);
-u32 pmm_alloc_pages(u32 count);
+u32 pmm_get_zone_free_pages(zone_type_t zone);
+u32 pmm_alloc_pages(u32 count, u32 flags);
 void pmm_free_pages(u32 addr, u32 count);
 
-#endif /* MM_BITMAP_H */
\ No newline at end of file
+/* Order based API: allocate/free a naturally aligned 2^order page block */
+u32 pmm_alloc_order(u32 order, u32 flags);
+void pmm_free_order(u32 addr, u32 order);
+
+/* Pre-zeroed page pool, topped up from the idle loop */
+typedef struct {
+	u32 count;	/* zeroed frames ready in the pool */
+	u32 capacity;	/* pool size */
+	u32 hits;	/* requests served from the pool */
+	u32 misses;	/* requests that had to clear a frame inline */
+	u32 refilled;	/* frames cleared in the background */
+} zero_pool_stats_t;
+
+/* Allocate a frame whose contents are guaranteed to be zero */
+u32 pmm_alloc_zeroed_page(u32 flags);
+/* Clear up to budget frames into the pool (idle context only) */
+void pmm_zero_pool_refill(u32 budget);
+void pmm_zero_pool_stats(zero_pool_stats_t *stats);
+
+#endif /* MM_BITMAP_H */
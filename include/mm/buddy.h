@@ -0,0 +1,70 @@
+#ifndef MM_BUDDY_H
+#define MM_BUDDY_H
+
+#include <kernel/kernel.h>
+#include <misc/list.h>
+
+/*
+ * Binary buddy allocator for physical page frames.
+ *
+ * Free memory is kept as naturally aligned blocks of 2^order pages, one free
+ * list per order and zone. Allocation splits the smallest sufficient block,
+ * freeing merges a block with its buddy as long as the buddy is free too.
+ *
+ * Free pages are not mapped, so list linkage lives in the struct page of
+ * the block's first frame (see mm/page.h): PG_BUDDY marks a free block head
+ * and page->private holds its order.
+ */
+#define BUDDY_MAX_ORDER 10
+#define BUDDY_NONE 0xFFFFFFFFu
+
+/*
+ * Physical memory is split into zones with separate free lists:
+ *   DMA    [0, 16 MiB)       ISA DMA capable, scarce
+ *   NORMAL [16 MiB, 896 MiB) safe to identity map below the kernel windows
+ *   HIGH   [896 MiB, ...)    only reachable through explicit mappings
+ * Both boundaries are multiples of a 2^BUDDY_MAX_ORDER block, so a buddy
+ * block (and its buddy) never straddles two zones.
+ */
+#define ZONE_DMA_END_PFN (0x01000000u >> PAGE_SHIFT)
+#define ZONE_NORMAL_END_PFN (0x38000000u >> PAGE_SHIFT)
+
+typedef enum {
+	ZONE_DMA,
+	ZONE_NORMAL,
+	ZONE_HIGH,
+	MAX_NR_ZONES
+} zone_type_t;
+
+struct zone {
+	const char *name;
+	u32 start_pfn;				/* first PFN in the zone */
+	u32 end_pfn;				/* one past the last PFN */
+	struct list_head free_area[BUDDY_MAX_ORDER + 1]; /* free block heads */
+	u32 nr_free[BUDDY_MAX_ORDER + 1];	/* free blocks per order */
+	u32 free_mask;				/* bit n set = order n non-empty */
+	u32 free_pages;				/* free pages in all lists */
+	u32 managed_pages;			/* pages given to the zone at boot */
+};
+
+extern struct zone g_zones[MAX_NR_ZONES];
+
+/* Set up empty zones covering [0, total_pages). Free memory is added
+ * afterwards with buddy_free_range(). Requires mem_map to be set up.
+ */
+void buddy_init(u32 total_pages);
+
+/* Zone a PFN belongs to */
+struct zone *pfn_to_zone(u32 pfn);
+
+/* Smallest order whose block holds at least count pages */
+u32 buddy_order_for(u32 count);
+
+/* Allocate a 2^order block from zone. Returns the first PFN or BUDDY_NONE. */
+u32 buddy_alloc(struct zone *zone, u32 order);
+/* Free a 2^order block previously returned by buddy_alloc */
+void buddy_free(u32 pfn, u32 order);
+/* Free an arbitrary run of pages, split into naturally aligned blocks */
+void buddy_free_range(u32 pfn, u32 count);
+
+#endif /* MM_BUDDY_H */
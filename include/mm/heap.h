@@ -10,13 +10,44 @@
  * heap_init() initializes kernel heap structures. kmalloc/kfree provide
  * dynamic memory allocation inside the kernel. kcalloc/krealloc are helper
  * variants and helper queries return heap statistics.
+ *
+ * Every pointer returned is at least KMALLOC_MIN_ALIGN aligned.
+ * kmalloc_aligned() raises that to any power of two; the padding in front
+ * of the object stays on the free lists. Alignment is virtual only: a
+ * page aligned buffer larger than a page is not physically contiguous.
+ * krealloc keeps the alignment only while it resizes in place.
  */
+#define KMALLOC_MIN_ALIGN 16
+#define KMALLOC_CACHE_LINE 64
+
+/* kmalloc_flags() flags */
+#define KMALLOC_ZERO (1 << 0)		/* clear the allocation */
+#define KMALLOC_ALIGN64 (1 << 1)	/* align to a KMALLOC_CACHE_LINE */
+#define KMALLOC_PAGE (1 << 2)		/* align to a page */
+
+typedef struct {
+	u32 realloc_inplace;	/* krealloc calls that kept the pointer */
+	u32 realloc_moved;	/* krealloc calls that copied to a new block */
+	u32 trimmed_pages;	/* pages given back to the PMM */
+} heap_stats_t;
+
 kernel_status_t heap_init(void);
 void *kmalloc(size_t size);
+/* Allocate size bytes aligned to align, a power of two */
+void *kmalloc_aligned(size_t size, size_t align);
+/* Allocate size bytes with KMALLOC_* flags */
+void *kmalloc_flags(size_t size, u32 flags);
 void *kcalloc(size_t num, size_t size);
 void *krealloc(void *ptr, size_t new_size);
 void kfree(void *ptr);
+/* Usable size of an allocation, 0 if ptr is not a live allocation */
+size_t ksize(const void *ptr);
 size_t heap_get_total_size(void);
 size_t heap_get_free_size(void);
+void heap_get_stats(heap_stats_t *stats);
+/* Give free heap pages back to the PMM. Returns the number of bytes
+ * released.
+ */
+size_t heap_trim(void);
 
 #endif /* MM_HEAP_H */
\ No newline at end of file
@@ -0,0 +1,76 @@
+#ifndef MM_PAGE_H
+#define MM_PAGE_H
+
+#include <kernel/kernel.h>
+#include <misc/list.h>
+
+/*
+ * Page frame database.
+ *
+ * mem_map holds one struct page per physical page frame, indexed by PFN.
+ * It lives in the identity mapped PMM metadata region, so PFN <-> metadata
+ * lookups are plain array arithmetic and never walk page tables.
+ */
+
+/* Page flags */
+#define PG_RESERVED (1 << 0)	/* never handed out (firmware, kernel, ...) */
+#define PG_BUDDY (1 << 1)	/* heads a free block in the buddy allocator */
+#define PG_SLAB (1 << 2)	/* backs a slab, owner = struct slab */
+#define PG_HEAP (1 << 3)	/* backs the kmalloc heap */
+#define PG_PAGETABLE (1 << 4)	/* used as a page table */
+#define PG_ANON (1 << 5)	/* anonymous VMA memory, owner = mm_struct */
+#define PG_VMALLOC (1 << 6)	/* backs a vmalloc area */
+
+struct page {
+	u32 flags;		/* PG_* flags */
+	u32 refcount;		/* 0 = free, set to 1 on allocation */
+	void *owner;		/* backpointer depending on flags */
+	struct list_head list;	/* buddy free list or owner's page list */
+	u32 private;		/* buddy: order of the free block,
+				 * page table: number of present PTEs
+				 */
+};
+
+extern struct page *mem_map;
+extern u32 max_pfn;
+
+static inline struct page *pfn_to_page(u32 pfn)
+{
+	return &mem_map[pfn];
+}
+
+static inline u32 page_to_pfn(const struct page *page)
+{
+	return (u32)(page - mem_map);
+}
+
+/* Return the descriptor for a physical address or NULL if unmanaged */
+static inline struct page *phys_to_page(u32 phys)
+{
+	u32 pfn = phys >> PAGE_SHIFT;
+	return pfn < max_pfn ? &mem_map[pfn] : NULL;
+}
+
+static inline u32 page_to_phys(const struct page *page)
+{
+	return page_to_pfn(page) << PAGE_SHIFT;
+}
+
+/* Take an extra reference on an allocated page */
+static inline void get_page(struct page *page)
+{
+	page->refcount++;
+}
+
+/* Initialize the database on top of storage for nr_pages descriptors. All
+ * pages start out reserved; the PMM clears PG_RESERVED for usable memory.
+ */
+void page_db_init(struct page *storage, u32 nr_pages);
+
+/* Tag an allocated page with its user and owner backpointer */
+void page_set_owner(u32 phys, u32 flags, void *owner);
+
+/* Drop a reference; the frame is returned to the PMM on the last one */
+void put_page(struct page *page);
+
+#endif /* MM_PAGE_H */
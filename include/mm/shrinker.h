@@ -0,0 +1,56 @@
+#ifndef MM_SHRINKER_H
+#define MM_SHRINKER_H
+
+#include <kernel/kernel.h>
+#include <misc/list.h>
+
+/*
+ * Memory pressure reclaim.
+ *
+ * Subsystems that hold on to free memory (empty slabs, the heap's free
+ * pages, page caches) register a shrinker. When free memory falls below the
+ * PMM's low watermark the PMM calls reclaim_wakeup() and the idle loop runs
+ * the shrinkers from reclaim_balance() until the high watermark is back.
+ * Allocators that hit an empty PMM call shrink_memory() directly and retry.
+ *
+ * Shrinkers run from ordinary allocation paths, so a shrinker must not
+ * allocate memory and must tolerate being called while its own subsystem
+ * waits for a page in a consistent state.
+ */
+struct shrinker {
+	const char *name;
+	/* pages the shrinker could free right now, an estimate */
+	u32 (*count)(struct shrinker *shrinker);
+	/* try to free nr_pages pages; returns the pages actually freed */
+	u32 (*scan)(struct shrinker *shrinker, u32 nr_pages);
+	struct list_head list;
+	u32 nr_calls;		/* scan calls */
+	u32 nr_reclaimed;	/* pages freed by scan */
+};
+
+typedef struct {
+	u32 low_wakeups;	/* times free memory fell below low */
+	u32 balance_runs;	/* background runs towards high */
+	u32 direct_runs;	/* shrink_memory calls from allocators */
+	u32 failed_runs;	/* runs that freed nothing */
+	u32 pages_reclaimed;	/* pages freed by all runs */
+} reclaim_stats_t;
+
+extern struct list_head shrinker_list;
+
+void register_shrinker(struct shrinker *shrinker);
+void unregister_shrinker(struct shrinker *shrinker);
+
+/* Run the shrinkers until nr_pages pages are freed or none is left.
+ * Returns the pages freed.
+ */
+u32 shrink_memory(u32 nr_pages);
+
+/* Called by the PMM when free memory drops below the low watermark */
+void reclaim_wakeup(void);
+/* Idle context: reclaim up to the high watermark after a wakeup */
+void reclaim_balance(void);
+
+void reclaim_get_stats(reclaim_stats_t *stats);
+
+#endif /* MM_SHRINKER_H */
@@ -4,19 +4,73 @@
 #include <kernel/kernel.h>
 #include <misc/list.h>
 #include <mm/heap.h>
+#include <mm/page.h>
 
 /*
  * Simple slab allocator API.
  *
  * A kmem_cache describes a cache of objects of a fixed size. Slabs
- * represent individual pages partitioned into objects.
+ * represent runs of 2^order contiguous pages partitioned into objects. The
+ * order is picked per cache to keep the unused tail of a slab small.
+ *
+ * The struct slab descriptor sits at the start of the slab for small
+ * objects. Caches of objects of at least SLAB_OFF_SLAB_MIN bytes kmalloc it
+ * instead, so it does not cost them an object. Either way every page of a
+ * slab points back to its descriptor through page->owner.
+ *
+ * Slabs are coloured: the unused tail of a slab is spent moving the first
+ * object of each new slab one cache line further, so objects with the same
+ * index in different slabs do not all compete for the same cache sets.
+ *
+ * Objects are handed out as they were freed, not cleared. A constructor
+ * runs once per object when its slab is created, and callers must free
+ * objects in their constructed state. For such caches the freelist link is
+ * kept behind the object instead of in its first word. Zeroed objects come
+ * from SLAB_FLAGS_ZERO caches or kmem_cache_zalloc(); zeroing an object of
+ * a constructed cache runs the constructor again.
  */
 
 #define SLAB_MIN_ALIGN 8u
+#define SLAB_MAX_ORDER 3		/* slabs of up to 8 pages */
+#define SLAB_OFF_SLAB_MIN (PAGE_SIZE / 8)
 #define SLAB_FLAGS_NONE 0u
+#define SLAB_FLAGS_NO_COLOUR (1u << 0)	/* start every slab at offset 0 */
+#define SLAB_FLAGS_ZERO (1u << 1)	/* zero objects on every allocation */
+
+/*
+ * kmalloc size classes: kmalloc() serves requests of up to
+ * KMALLOC_MAX_CACHE_SIZE bytes from the power-of-two caches kmalloc-16 ..
+ * kmalloc-2048, with objects naturally aligned to their size. Larger
+ * requests go to the heap or to vmalloc. The smallest class matches the
+ * heap's 16-byte alignment, so every kmalloc pointer is at least 16-byte
+ * aligned.
+ */
+#define KMALLOC_MIN_SHIFT 4
+#define KMALLOC_MAX_SHIFT 11
+#define KMALLOC_MAX_CACHE_SIZE (1u << KMALLOC_MAX_SHIFT)
+#define KMALLOC_NR_CACHES (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
 
 typedef void (*ctor_t)(void *);
 
+/*
+ * Per-CPU object magazine (array cache) in front of the slab lists.
+ * kmem_cache_alloc pops from entry[] and kmem_cache_free pushes to it; only
+ * an empty or full magazine goes to the slab lists, moving batchcount
+ * objects at a time.
+ */
+#define SLAB_MAG_MAX 32
+
+struct array_cache {
+	u32 avail;		/* objects in entry[] */
+	u32 limit;		/* capacity, at most SLAB_MAG_MAX */
+	u32 batchcount;		/* objects moved per refill or drain */
+	u32 allochit;		/* allocations served from entry[] */
+	u32 allocmiss;		/* allocations that needed a refill */
+	u32 freehit;		/* frees that fit into entry[] */
+	u32 freemiss;		/* frees that needed a drain */
+	void *entry[SLAB_MAG_MAX];
+};
+
 /* Forward declarations */
 struct kmem_cache;
 struct slab;
@@ -26,12 +80,20 @@ struct kmem_cache {
 	/* immutable after creation */
 	const char *name;
 	u32 object_size;	/* size actually used for allocations */
+	u32 slot_size;		/* object_size plus an outside freelist link */
+	u32 free_offset;	/* offset of the freelist link in an object */
 	u32 align;		/* object alignment (power of two) */
 	u32 flags;
 	ctor_t ctor;
 
-	/* derived: objects per slab */
+	/* derived: slab layout */
 	u32 objects_per_slab;
+	u32 order;		/* slabs are 2^order pages */
+	u32 obj_offset;		/* offset of the first object in a slab */
+	bool off_slab;		/* struct slab is kmalloc'ed */
+	u32 colour;		/* number of distinct slab colours */
+	u32 colour_off;		/* bytes between two colours */
+	u32 colour_next;	/* colour of the next slab */
 
 	/* slab lists (full/partial/free) */
 	struct list_head slabs_full;
@@ -40,17 +102,22 @@ struct kmem_cache {
 
 	/* node for global caches list */
 	struct list_head list;
+
+	/* per-CPU magazines */
+	struct array_cache cpu_cache[NR_CPUS];
 };
 
 /*
- * slab structure represents metadata stored at page beginning for
- * a slab. 'freelist' points to the first free object within the slab.
+ * slab structure represents metadata for a slab, stored at its beginning
+ * or off-slab. 'freelist' points to the first free object within the slab.
  */
 struct slab {
 	struct kmem_cache *cache; /* owning cache */
 	void *freelist;	     /* head of free object linked list */
 	u32 inuse;		     /* number of allocated objects */
 	struct list_head list;	     /* node in cache slab lists */
+	struct page *page;	     /* descriptor of the first frame */
+	void *base;		     /* virtual address of the first page */
 };
 
 /* Global list of caches */
@@ -63,11 +130,29 @@ struct kmem_cache *kmem_cache_create(const char *name, uint32_t size,
 				     ctor_t ctor);
 void kmem_cache_destroy(struct kmem_cache *cache);
 void *kmem_cache_alloc(struct kmem_cache *cache);
+/* kmem_cache_alloc returning a zeroed object */
+void *kmem_cache_zalloc(struct kmem_cache *cache);
 void kmem_cache_free(struct kmem_cache *cache, void *obj);
+/* Allocate n objects into objs, filling them from whole slab freelists.
+ * Returns n, or 0 with nothing allocated on failure.
+ */
+u32 kmem_cache_alloc_bulk(struct kmem_cache *cache, u32 n, void **objs);
+/* Free n objects straight back to their slabs. NULL entries are skipped. */
+void kmem_cache_free_bulk(struct kmem_cache *cache, u32 n, void **objs);
 
-/* Try to shrink the cache by freeing slabs on its slabs_free list back to
- * the physical allocator. Best-effort and may leave some slabs for reuse.
+/* Try to shrink the cache by draining its magazines and freeing slabs on
+ * its slabs_free list back to the physical allocator. Returns the number
+ * of pages freed. Registered as the "slab" shrinker for all caches.
  */
-void kmem_cache_shrink(struct kmem_cache *cache);
+u32 kmem_cache_shrink(struct kmem_cache *cache);
+/* Return every object held in the per-CPU magazines to its slab */
+void kmem_cache_drain(struct kmem_cache *cache);
+
+/* kmalloc cache serving size bytes, or NULL if the heap must be used */
+struct kmem_cache *kmalloc_slab(size_t size);
+/* True if ptr lies in a live slab page, i.e. came from a kmem_cache */
+bool slab_owns(const void *ptr);
+/* Cache an object returned by kmem_cache_alloc belongs to */
+struct kmem_cache *slab_obj_cache(const void *obj);
 
 #endif /* MM_SLAB_H */
\ No newline at end of file
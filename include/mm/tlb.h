@@ -0,0 +1,57 @@
+#ifndef MM_TLB_H
+#define MM_TLB_H
+
+#include <kernel/kernel.h>
+#include <mm/page.h>
+
+/*
+ * Batched TLB invalidation for range unmaps (mmu_gather).
+ *
+ * Unmap paths clear PTEs and hand them to a gather instead of issuing an
+ * invlpg per page. The gather tracks the affected virtual range and the
+ * frames to release; tlb_flush_mmu() invalidates the range once, with one
+ * invlpg per page for small ranges or a CR3 reload above
+ * tlb_flush_threshold pages, and only then returns the frames to the PMM.
+ * Page tables emptied by the unmap are released the same way.
+ *
+ *	struct mmu_gather tlb;
+ *	tlb_gather_mmu(&tlb, true);
+ *	vmm_unmap_range_gather(&tlb, start, size);
+ *	tlb_finish_mmu(&tlb);
+ */
+#define MMU_GATHER_BATCH 64	/* frames queued before a forced flush */
+
+struct mmu_gather {
+	u32 start;		/* lowest unmapped address, inclusive */
+	u32 end;		/* highest unmapped address, exclusive */
+	bool need_flush_all;	/* a global translation was removed */
+	bool free_frames;	/* release the frames behind cleared PTEs */
+	u32 nr_pages;
+	struct page *pages[MMU_GATHER_BATCH];
+};
+
+/* Ranges of more pages than this are flushed with a CR3 reload */
+extern u32 tlb_flush_threshold;
+
+typedef struct {
+	u32 invlpg_flushes;	/* flushes done page by page */
+	u32 full_flushes;	/* flushes done with a CR3 reload */
+	u32 frames_freed;	/* frames returned after a flush */
+} tlb_stats_t;
+
+/* Start a gather. With free_frames the frames of cleared PTEs are put. */
+void tlb_gather_mmu(struct mmu_gather *tlb, bool free_frames);
+/* Record a PTE that was just cleared at virt */
+void tlb_remove_pte(struct mmu_gather *tlb, u32 virt, u32 pte);
+/* Record a page table frame detached from its directory */
+void tlb_remove_table(struct mmu_gather *tlb, u32 pt_phys);
+/* Record a range that lost its translation, with no frames to release */
+void tlb_add_range(struct mmu_gather *tlb, u32 virt, u32 size, bool global);
+/* Invalidate everything recorded so far and release the queued frames */
+void tlb_flush_mmu(struct mmu_gather *tlb);
+/* Final flush; the gather may not be used afterwards */
+void tlb_finish_mmu(struct mmu_gather *tlb);
+
+void tlb_get_stats(tlb_stats_t *stats);
+
+#endif /* MM_TLB_H */
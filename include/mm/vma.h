@@ -2,6 +2,7 @@
 #define MM_VMA_H
 
 #include <kernel/kernel.h>
+#include <misc/rbtree.h>
 #include <mm/vmm.h>
 
 /*
@@ -9,6 +10,17 @@
  *
  * This header declares structures and helpers for representing ranges of
  * virtual address space that are backed by memory mappings.
+ *
+ * An mm_struct keeps its VMAs twice: in mm->mmap, a list sorted by address
+ * for iteration, and in mm->mm_rb, a red-black tree for O(log n) lookup.
+ * Each tree node caches the largest gap in its subtree, where the gap of a
+ * VMA is the free space between the previous VMA's end and its start, so
+ * unmapped_area() finds the lowest fitting hole without a linear scan.
+ *
+ * find_vma() first looks in mm->vmacache, the last few VMAs it returned,
+ * indexed by the page of the looked up address. Faults tend to hit the
+ * same VMAs again and again, and a hit skips the tree walk. Every change
+ * to the VMA set flushes the cache.
  */
 
 /* VM flags */
@@ -21,21 +33,28 @@
 /* Flags for mmap_anonymous() to influence mapping behaviour */
 #define VM_MAP_IMMEDIATE (1 << 16) /* allocate & map pages immediately */
 
-#define PAGE_SHIFT 12 /* standard shift for 4KB pages */
 #ifndef PAGE_SIZE
 #define PAGE_SIZE (1UL << PAGE_SHIFT)
 #endif
 
 #define PHYS_PFN(addr) ((addr) >> PAGE_SHIFT) /* convert address to PFN */
 
+#define VMACACHE_SIZE 4
+#define VMACACHE_MASK (VMACACHE_SIZE - 1)
+
 /* Forward declarations */
 struct vm_area_struct;
 struct mm_struct;
 
 /* mm_struct represents an address space and holds linked list of VMAs */
 typedef struct mm_struct {
-	struct vm_area_struct *mmap; /* singly-linked sorted by address */
+	struct vm_area_struct *mmap; /* list sorted by address */
+	struct rb_root mm_rb;	     /* the same VMAs, as a tree */
+	unsigned long highest_vm_end; /* end of the last VMA */
 	u32 map_count;
+	struct vm_area_struct *vmacache[VMACACHE_SIZE]; /* recent finds */
+	u32 vmacache_hits;
+	u32 vmacache_misses;
 } mm_struct;
 
 /* VMA structure representing a contiguous virtual mapping */
@@ -44,7 +63,10 @@ typedef struct vm_area_struct {
 	unsigned long vm_end;   /* exclusive end address */
 	unsigned long vm_pgoff; /* page offset for mapping */
 	u32 vm_flags;	       /* VM_* flags */
-	struct vm_area_struct *vm_next;
+	struct vm_area_struct *vm_next, *vm_prev;
+	struct rb_node vm_rb;
+	/* largest gap before any VMA in this subtree */
+	unsigned long rb_subtree_gap;
 } vm_area_struct;
 
 /* helpers */
@@ -63,6 +85,9 @@ void mm_destroy(mm_struct *mm);
 vm_area_struct *vm_area_alloc(void);
 void vm_area_free(vm_area_struct *vma);
 
+/* Drop the cached find_vma() results of mm */
+void vmacache_flush(mm_struct *mm);
+
 /* Find VMA containing or next after addr */
 vm_area_struct *find_vma(mm_struct *mm, unsigned long addr);
 /* Find previous vma before addr; if prevp provided store prev */
@@ -84,6 +109,9 @@ vm_area_struct *split_vma_at(mm_struct *mm, vm_area_struct *vma,
  *  - len: length in bytes (will be page-aligned)
  *  - flags: VM_* or VM_MAP_IMMEDIATE
  *
+ * A mapping that abuts a VMA with the same flags extends that VMA instead of
+ * adding one, and one that fills the hole between two such VMAs joins them.
+ *
  * Returns KERNEL_OK on success, negative kernel_status_t on error. On success
  * if out_addr != NULL then *out_addr contains the mapping start.
  */
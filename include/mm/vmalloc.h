@@ -0,0 +1,92 @@
+#ifndef MM_VMALLOC_H
+#define MM_VMALLOC_H
+
+#include <kernel/kernel.h>
+#include <misc/rbtree.h>
+#include <mm/vmm.h>
+#include <stddef.h>
+
+/*
+ * Kernel virtual address space allocator.
+ *
+ * Kernel VA in [VMALLOC_START, VMALLOC_END) is handed out in page multiples
+ * by alloc_vmap_area() and given back by free_vmap_area(), so slabs,
+ * vmalloc buffers and vmap mappings reuse the address space they release.
+ * Fixed windows (the kmalloc heap, identity mapped firmware and MMIO) are
+ * taken out once with vmap_reserve().
+ *
+ * Free ranges sit in an rbtree sorted by address and augmented with the
+ * largest free range in each subtree, so the lowest fitting range is found
+ * in O(log n). Allocated ranges sit in a second tree for lookup by address.
+ *
+ * The struct vmap_area descriptors themselves come from pages mapped at
+ * [VMAP_META_START, VMAP_META_END), outside the arena, so allocating one
+ * never recurses into kmalloc or the arena.
+ */
+#define VMALLOC_START 0xD0000000
+#define VMALLOC_END 0xFF400000
+#define VMAP_META_START VMALLOC_END
+#define VMAP_META_END VMM_TEMP_MAP_ADDR
+
+/* vmap_area flags */
+#define VMAP_RAW 0		/* plain VA range, e.g. a slab */
+#define VMAP_VMALLOC (1 << 0)	/* pages owned by the area, freed by vfree */
+#define VMAP_VMAP (1 << 1)	/* caller's frames mapped by vmap */
+#define VMAP_GUARD (1 << 2)	/* last page is an unmapped guard page */
+
+struct vmap_area {
+	u32 va_start;
+	u32 va_end;		/* exclusive */
+	u32 subtree_max_size;	/* free tree: largest range in the subtree */
+	u32 flags;		/* VMAP_* */
+	union {
+		struct rb_node rb_node;		/* free or busy tree */
+		struct vmap_area *next_free;	/* descriptor pool */
+	};
+};
+
+typedef struct {
+	u32 free_bytes;		/* VA in free ranges */
+	u32 used_bytes;		/* VA in allocated areas */
+	u32 reserved_bytes;	/* VA taken by vmap_reserve */
+	u32 largest_free;	/* largest free range */
+	u32 nr_free;		/* free ranges */
+	u32 nr_busy;		/* allocated areas */
+	u32 vmalloc_pages;	/* pages backing vmalloc areas */
+} vmalloc_stats_t;
+
+kernel_status_t vmalloc_init(void);
+
+/* Take [start, start + size) out of the arena for good. Parts outside the
+ * arena or already taken are ignored.
+ */
+kernel_status_t vmap_reserve(u32 start, u32 size);
+
+/* Allocate size bytes of VA aligned to align (both rounded up to pages).
+ * Returns the start address or 0.
+ */
+u32 alloc_vmap_area(u32 size, u32 align, u32 flags);
+/* Release an area returned by alloc_vmap_area. The pages must already be
+ * unmapped.
+ */
+void free_vmap_area(u32 addr);
+
+/* Virtually contiguous memory backed by individual page frames */
+void *vmalloc(size_t size);
+void *vzalloc(size_t size);
+void vfree(const void *addr);
+
+/* Map count frames at consecutive addresses with page_flags (PAGE_FLAG_*
+ * cache bits are honoured). The frames stay owned by the caller.
+ */
+void *vmap(const u32 *frames, u32 count, u32 page_flags);
+void vunmap(const void *addr);
+
+/* True if addr is the start of a vmalloc or vmap area */
+bool is_vmalloc_addr(const void *addr);
+/* Usable bytes of the vmalloc area starting at addr, 0 if none */
+size_t vmalloc_size(const void *addr);
+
+void vmalloc_get_stats(vmalloc_stats_t *stats);
+
+#endif /* MM_VMALLOC_H */
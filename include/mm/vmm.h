@@ -16,10 +16,37 @@
 #define PAGE_FLAG_PRESENT (1 << 0)
 #define PAGE_FLAG_RW (1 << 1)
 #define PAGE_FLAG_USER (1 << 2)
+#define PAGE_FLAG_PWT (1 << 3)
+#define PAGE_FLAG_PCD (1 << 4)
+#define PAGE_FLAG_LARGE (1 << 7)	/* PDE maps a 4 MiB page (PSE) */
 #define PAGE_FLAG_GLOBAL (1 << 8)
 
+#define LARGE_PAGE_SIZE 0x400000
+
+/*
+ * Memory types. vmm_init reprograms PAT entry 1 (selected by PWT alone) from
+ * write-through to write-combining; PAT entry 3 stays uncacheable. Without
+ * PAT support PAGE_FLAG_WC must not be used, see vmm_pat_enabled().
+ */
+#define PAGE_FLAG_WC PAGE_FLAG_PWT
+#define PAGE_FLAG_UC (PAGE_FLAG_PWT | PAGE_FLAG_PCD)
+#define PAGE_CACHE_MASK (PAGE_FLAG_PWT | PAGE_FLAG_PCD)
+
+/* Scratch page used to access frames that are not mapped anywhere else */
+#define VMM_TEMP_MAP_ADDR 0xFF800000
+
+/*
+ * Mapping policy: translations that are identical in every address space
+ * (identity region, heap, slabs, framebuffer) use PAGE_FLAGS_KERNEL and stay
+ * in the TLB across CR3 reloads. Per-address-space mappings (VMAs, the temp
+ * slot) must not set PAGE_FLAG_GLOBAL.
+ */
+#define PAGE_FLAGS_KERNEL (PAGE_FLAG_PRESENT | PAGE_FLAG_RW | PAGE_FLAG_GLOBAL)
+
 #ifndef PTE_FLAGS_MASK
-#define PTE_FLAGS_MASK (PAGE_FLAG_PRESENT | PAGE_FLAG_RW | PAGE_FLAG_USER)
+#define PTE_FLAGS_MASK                                                     \
+	(PAGE_FLAG_PRESENT | PAGE_FLAG_RW | PAGE_FLAG_USER | PAGE_CACHE_MASK  \
+	 | PAGE_FLAG_GLOBAL)
 #endif
 
 /* Page directory and table types aligned to 4K for hardware requirements */
@@ -36,12 +63,54 @@ kernel_status_t vmm_unmap_page(u32 virt_addr);
 kernel_status_t vmm_map_pages(u32 virt_addr, u32 phys_addr, u32 count,
 			      u32 flags);
 kernel_status_t vmm_unmap_pages(u32 virt_addr, u32 count);
+/* Unmap every present page in [virt_start, virt_start+size), skipping holes.
+ * Each page table is visited once and freed when it becomes empty.
+ */
+kernel_status_t vmm_unmap_range(u32 virt_start, u32 size);
+/* Same, but TLB invalidation and freeing are batched in tlb (mm/tlb.h) */
+struct mmu_gather;
+kernel_status_t vmm_unmap_range_gather(struct mmu_gather *tlb, u32 virt_start,
+				       u32 size);
 kernel_status_t vmm_map_if_not_mapped(u32 phys_start, u32 size);
 u32 vmm_get_physical_addr(u32 virt_addr);
+/* True if the 4 MiB region around virt_addr has a page table or large page */
+bool vmm_pde_present(u32 virt_addr);
 void vmm_switch_directory(page_directory_t *dir);
 void vmm_enable_paging(void);
 
+/* Map a frame at VMM_TEMP_MAP_ADDR and return a pointer to it. There is a
+ * single slot: callers must vmm_unmap_temp() before mapping another frame
+ * and must not use it from interrupt context.
+ */
+void *vmm_map_temp(u32 phys);
+void vmm_unmap_temp(void);
+
+/* Map one 4 MiB page. Both addresses must be 4 MiB aligned; returns
+ * KERNEL_NOT_IMPLEMENTED if the CPU lacks PSE. A page table already covering
+ * the range is replaced only if all its present entries agree with the new
+ * mapping.
+ */
+kernel_status_t vmm_map_large(u32 virt_addr, u32 phys_addr, u32 flags);
+bool vmm_large_pages_enabled(void);
+bool vmm_pat_enabled(void);
+/* Size of the framebuffer mapping made by vmm_init. It may be rounded up
+ * to whole 4 MiB pages, so cache attribute changes over this range keep
+ * the large pages intact.
+ */
+u32 vmm_fb_map_size(void);
+
+/* Change the memory type (PAGE_CACHE_MASK bits) of every mapped page in
+ * [virt_start, virt_start+size) and flush the TLB.
+ */
+kernel_status_t vmm_set_cache_attr(u32 virt_start, u32 size, u32 cache_flags);
+
+/* Flush non-global TLB entries (CR3 reload) */
+void vmm_flush_tlb(void);
+/* Flush every TLB entry, global kernel mappings included */
+void vmm_flush_tlb_all(void);
+
 /* New helpers */
+/* Uses 4 MiB pages for every large-page aligned chunk when PSE is enabled */
 kernel_status_t vmm_map_range(u32 virt_start, u32 phys_start, u32 size,
 			      u32 flags);
 bool vmm_is_range_mapped(u32 virt_start, u32 size);
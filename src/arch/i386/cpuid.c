@@ -80,6 +80,24 @@ kernel_status_t cpuid_get_features(cpuid_features_t *features)
 	return KERNEL_OK;
 }
 
+bool cpuid_has_feature_edx(u32 mask)
+{
+	cpuid_features_t features;
+	if (cpuid_get_features(&features) != KERNEL_OK)
+		return false;
+	return (features.edx & mask) == mask;
+}
+
+u32 cpuid_cache_line_size(void)
+{
+	cpuid_features_t features;
+	if (cpuid_get_features(&features) != KERNEL_OK
+	    || !(features.edx & CPUID_FEAT_EDX_CLFSH))
+		return 0;
+	/* EBX[15:8] is the CLFLUSH line size in 8-byte units */
+	return ((features.ebx >> 8) & 0xFF) * 8;
+}
+
 kernel_status_t cpuid_get_extended(cpuid_extended_t *extended)
 {
 	if (!extended)
@@ -90,8 +90,10 @@ static void keyboard_handler(registers_t *regs)
 
 char ps2_get_char(void)
 {
-	while (buffer_head == buffer_tail)
+	while (buffer_head == buffer_tail) {
+		kernel_idle();
 		cpu_relax(); /* busy-wait with hint if available */
+	}
 
 	char c = keyboard_buffer[buffer_head];
 	buffer_head = (buffer_head + 1) % KEYBOARD_BUFFER_SIZE;
@@ -22,7 +22,9 @@
 #include <misc/shell.h>
 #include <mm/bitmap.h>
 #include <mm/heap.h>
+#include <mm/shrinker.h>
 #include <mm/slab.h>
+#include <mm/vmalloc.h>
 #include <mm/vmm.h>
 #include <printf.h>
 
@@ -33,6 +35,16 @@
 u32 _multiboot_info_ptr = 0;
 terminal_t g_terminal;
 
+/* Frames cleared per idle call; small so input latency stays low */
+#define IDLE_ZERO_BUDGET 4
+
+/* Called from idle loops (including the keyboard wait loop) */
+void kernel_idle(void)
+{
+	reclaim_balance();
+	pmm_zero_pool_refill(IDLE_ZERO_BUDGET);
+}
+
 /* Kernel entry */
 void kernel_main(u32 multiboot_magic, multiboot_info_t *multiboot_info)
 {
@@ -83,13 +95,23 @@ void kernel_main(u32 multiboot_magic, multiboot_info_t *multiboot_info)
         kernel_panic("initrd_init failed");
     }
 
+	/* the heap window and slabs come out of the vmalloc arena */
+	status = vmalloc_init();
+	if (status != KERNEL_OK) {
+		kernel_panic("vmalloc_init failed");
+	}
+
+	/* kmalloc caches are built on top of the heap */
+	status = heap_init();
+	if (status != KERNEL_OK) {
+		kernel_panic("heap_init failed");
+	}
+
     status = slab_init();
     if (status != KERNEL_OK) {
         kernel_panic("slab_init failed");
     }
 
-	heap_init();
-
 	/* ACPI, time and input */
 	acpi_init();
 	time_init();
@@ -103,6 +125,7 @@ void kernel_main(u32 multiboot_magic, multiboot_info_t *multiboot_info)
 
 	/* Idle */
 	for (;;) {
+		kernel_idle();
 		draw_status();
 		asm volatile("hlt");
 	}
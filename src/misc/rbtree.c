@@ -0,0 +1,472 @@
+#include <misc/rbtree.h>
+
+/*
+ * Red-black tree rebalancing.
+ *
+ * Properties kept by insert and erase:
+ *   1) every node is red or black
+ *   2) the root is black
+ *   3) a red node has no red children
+ *   4) every path from a node to its leaves has the same number of black
+ *      nodes
+ * so the longest path is at most twice the shortest one.
+ *
+ * Rotations report the two nodes that swapped places to augment_rotate so
+ * that augmented trees can fix their cached values.
+ */
+#define RB_RED 0
+#define RB_BLACK 1
+
+#define __rb_parent(pc) ((struct rb_node *)((pc) & ~3UL))
+#define __rb_color(pc) ((pc) & 1)
+#define __rb_is_black(pc) __rb_color(pc)
+#define __rb_is_red(pc) (!__rb_color(pc))
+#define rb_is_red(rb) __rb_is_red((rb)->__rb_parent_color)
+#define rb_is_black(rb) __rb_is_black((rb)->__rb_parent_color)
+
+typedef void (*rb_rotate_fn)(struct rb_node *old, struct rb_node *new);
+
+/* The parent of a red node is its parent_color word as is */
+static inline struct rb_node *rb_red_parent(struct rb_node *red)
+{
+	return (struct rb_node *)red->__rb_parent_color;
+}
+
+static inline void rb_set_parent(struct rb_node *rb, struct rb_node *p)
+{
+	rb->__rb_parent_color = __rb_color(rb->__rb_parent_color)
+				| (unsigned long)p;
+}
+
+static inline void rb_set_parent_color(struct rb_node *rb, struct rb_node *p,
+				       int color)
+{
+	rb->__rb_parent_color = (unsigned long)p | color;
+}
+
+static inline void rb_set_black(struct rb_node *rb)
+{
+	rb->__rb_parent_color |= RB_BLACK;
+}
+
+/* Point whatever referenced old (parent or root) at new */
+static inline void rb_change_child(struct rb_node *old, struct rb_node *new,
+				   struct rb_node *parent, struct rb_root *root)
+{
+	if (parent) {
+		if (parent->rb_left == old)
+			parent->rb_left = new;
+		else
+			parent->rb_right = new;
+	} else {
+		root->rb_node = new;
+	}
+}
+
+/* new takes old's parent and colour, old becomes new's child */
+static inline void rb_rotate_set_parents(struct rb_node *old,
+					 struct rb_node *new,
+					 struct rb_root *root, int color)
+{
+	struct rb_node *parent = rb_parent(old);
+	new->__rb_parent_color = old->__rb_parent_color;
+	rb_set_parent_color(old, new, color);
+	rb_change_child(old, new, parent, root);
+}
+
+static void rb_insert_fixup(struct rb_node *node, struct rb_root *root,
+			    rb_rotate_fn augment_rotate)
+{
+	struct rb_node *parent = rb_red_parent(node), *gparent, *tmp;
+
+	while (true) {
+		/* the new node is red; done once its parent is black */
+		if (!parent) {
+			rb_set_parent_color(node, NULL, RB_BLACK);
+			break;
+		}
+		if (rb_is_black(parent))
+			break;
+
+		gparent = rb_red_parent(parent);
+		tmp = gparent->rb_right;
+		if (parent != tmp) {
+			/* parent is the left child */
+			if (tmp && rb_is_red(tmp)) {
+				/* red uncle: recolour and continue above */
+				rb_set_parent_color(tmp, gparent, RB_BLACK);
+				rb_set_parent_color(parent, gparent, RB_BLACK);
+				node = gparent;
+				parent = rb_parent(node);
+				rb_set_parent_color(node, parent, RB_RED);
+				continue;
+			}
+
+			tmp = parent->rb_right;
+			if (node == tmp) {
+				/* inner child: left rotate at parent */
+				tmp = node->rb_left;
+				parent->rb_right = tmp;
+				node->rb_left = parent;
+				if (tmp)
+					rb_set_parent_color(tmp, parent,
+							    RB_BLACK);
+				rb_set_parent_color(parent, node, RB_RED);
+				augment_rotate(parent, node);
+				parent = node;
+				tmp = node->rb_right;
+			}
+
+			/* outer child: right rotate at gparent */
+			gparent->rb_left = tmp;
+			parent->rb_right = gparent;
+			if (tmp)
+				rb_set_parent_color(tmp, gparent, RB_BLACK);
+			rb_rotate_set_parents(gparent, parent, root, RB_RED);
+			augment_rotate(gparent, parent);
+			break;
+		} else {
+			/* mirror image: parent is the right child */
+			tmp = gparent->rb_left;
+			if (tmp && rb_is_red(tmp)) {
+				rb_set_parent_color(tmp, gparent, RB_BLACK);
+				rb_set_parent_color(parent, gparent, RB_BLACK);
+				node = gparent;
+				parent = rb_parent(node);
+				rb_set_parent_color(node, parent, RB_RED);
+				continue;
+			}
+
+			tmp = parent->rb_left;
+			if (node == tmp) {
+				tmp = node->rb_right;
+				parent->rb_left = tmp;
+				node->rb_right = parent;
+				if (tmp)
+					rb_set_parent_color(tmp, parent,
+							    RB_BLACK);
+				rb_set_parent_color(parent, node, RB_RED);
+				augment_rotate(parent, node);
+				parent = node;
+				tmp = node->rb_left;
+			}
+
+			gparent->rb_right = tmp;
+			parent->rb_left = gparent;
+			if (tmp)
+				rb_set_parent_color(tmp, gparent, RB_BLACK);
+			rb_rotate_set_parents(gparent, parent, root, RB_RED);
+			augment_rotate(gparent, parent);
+			break;
+		}
+	}
+}
+
+/* Restore the black height after a black node was removed below parent */
+static void rb_erase_fixup(struct rb_node *parent, struct rb_root *root,
+			   rb_rotate_fn augment_rotate)
+{
+	struct rb_node *node = NULL, *sibling, *tmp1, *tmp2;
+
+	while (true) {
+		/* node is one black short; it is NULL on the first pass */
+		sibling = parent->rb_right;
+		if (node != sibling) {
+			/* node is the left child */
+			if (rb_is_red(sibling)) {
+				/* red sibling: left rotate at parent */
+				tmp1 = sibling->rb_left;
+				parent->rb_right = tmp1;
+				sibling->rb_left = parent;
+				rb_set_parent_color(tmp1, parent, RB_BLACK);
+				rb_rotate_set_parents(parent, sibling, root,
+						      RB_RED);
+				augment_rotate(parent, sibling);
+				sibling = tmp1;
+			}
+
+			tmp1 = sibling->rb_right;
+			if (!tmp1 || rb_is_black(tmp1)) {
+				tmp2 = sibling->rb_left;
+				if (!tmp2 || rb_is_black(tmp2)) {
+					/* black nephews: recolour sibling */
+					rb_set_parent_color(sibling, parent,
+							    RB_RED);
+					if (rb_is_red(parent)) {
+						rb_set_black(parent);
+					} else {
+						node = parent;
+						parent = rb_parent(node);
+						if (parent)
+							continue;
+					}
+					break;
+				}
+
+				/* red inner nephew: right rotate at sibling */
+				tmp1 = tmp2->rb_right;
+				sibling->rb_left = tmp1;
+				tmp2->rb_right = sibling;
+				parent->rb_right = tmp2;
+				if (tmp1)
+					rb_set_parent_color(tmp1, sibling,
+							    RB_BLACK);
+				augment_rotate(sibling, tmp2);
+				tmp1 = sibling;
+				sibling = tmp2;
+			}
+
+			/* red outer nephew: left rotate at parent */
+			tmp2 = sibling->rb_left;
+			parent->rb_right = tmp2;
+			sibling->rb_left = parent;
+			rb_set_parent_color(tmp1, sibling, RB_BLACK);
+			if (tmp2)
+				rb_set_parent(tmp2, parent);
+			rb_rotate_set_parents(parent, sibling, root, RB_BLACK);
+			augment_rotate(parent, sibling);
+			break;
+		} else {
+			/* mirror image: node is the right child */
+			sibling = parent->rb_left;
+			if (rb_is_red(sibling)) {
+				tmp1 = sibling->rb_right;
+				parent->rb_left = tmp1;
+				sibling->rb_right = parent;
+				rb_set_parent_color(tmp1, parent, RB_BLACK);
+				rb_rotate_set_parents(parent, sibling, root,
+						      RB_RED);
+				augment_rotate(parent, sibling);
+				sibling = tmp1;
+			}
+
+			tmp1 = sibling->rb_left;
+			if (!tmp1 || rb_is_black(tmp1)) {
+				tmp2 = sibling->rb_right;
+				if (!tmp2 || rb_is_black(tmp2)) {
+					rb_set_parent_color(sibling, parent,
+							    RB_RED);
+					if (rb_is_red(parent)) {
+						rb_set_black(parent);
+					} else {
+						node = parent;
+						parent = rb_parent(node);
+						if (parent)
+							continue;
+					}
+					break;
+				}
+
+				tmp1 = tmp2->rb_left;
+				sibling->rb_right = tmp1;
+				tmp2->rb_left = sibling;
+				parent->rb_left = tmp2;
+				if (tmp1)
+					rb_set_parent_color(tmp1, sibling,
+							    RB_BLACK);
+				augment_rotate(sibling, tmp2);
+				tmp1 = sibling;
+				sibling = tmp2;
+			}
+
+			tmp2 = sibling->rb_right;
+			parent->rb_left = tmp2;
+			sibling->rb_right = parent;
+			rb_set_parent_color(tmp1, sibling, RB_BLACK);
+			if (tmp2)
+				rb_set_parent(tmp2, parent);
+			rb_rotate_set_parents(parent, sibling, root, RB_BLACK);
+			augment_rotate(parent, sibling);
+			break;
+		}
+	}
+}
+
+/* Unlink node from the tree. Returns the node to start rebalancing at, or
+ * NULL if the black height did not change.
+ */
+static struct rb_node *rb_erase_node(struct rb_node *node, struct rb_root *root,
+				     const struct rb_augment_callbacks *augment)
+{
+	struct rb_node *child = node->rb_right;
+	struct rb_node *tmp = node->rb_left;
+	struct rb_node *parent, *rebalance;
+	unsigned long pc;
+
+	if (!tmp) {
+		/* at most a right child, which then is red: it takes over
+		 * node's place and colour
+		 */
+		pc = node->__rb_parent_color;
+		parent = __rb_parent(pc);
+		rb_change_child(node, child, parent, root);
+		if (child) {
+			child->__rb_parent_color = pc;
+			rebalance = NULL;
+		} else {
+			rebalance = __rb_is_black(pc) ? parent : NULL;
+		}
+		tmp = parent;
+	} else if (!child) {
+		/* only a (red) left child */
+		tmp->__rb_parent_color = pc = node->__rb_parent_color;
+		parent = __rb_parent(pc);
+		rb_change_child(node, tmp, parent, root);
+		rebalance = NULL;
+		tmp = parent;
+	} else {
+		/* two children: the in-order successor takes node's place */
+		struct rb_node *successor = child, *child2;
+
+		tmp = child->rb_left;
+		if (!tmp) {
+			/* the right child is the successor */
+			parent = successor;
+			child2 = successor->rb_right;
+			augment->copy(node, successor);
+		} else {
+			/* leftmost node of the right subtree */
+			do {
+				parent = successor;
+				successor = tmp;
+				tmp = tmp->rb_left;
+			} while (tmp);
+			child2 = successor->rb_right;
+			parent->rb_left = child2;
+			successor->rb_right = child;
+			rb_set_parent(child, successor);
+			augment->copy(node, successor);
+			augment->propagate(parent, successor);
+		}
+
+		tmp = node->rb_left;
+		successor->rb_left = tmp;
+		rb_set_parent(tmp, successor);
+
+		pc = node->__rb_parent_color;
+		tmp = __rb_parent(pc);
+		rb_change_child(node, successor, tmp, root);
+
+		if (child2) {
+			rb_set_parent_color(child2, parent, RB_BLACK);
+			rebalance = NULL;
+		} else {
+			rebalance = rb_is_black(successor) ? parent : NULL;
+		}
+		successor->__rb_parent_color = pc;
+		tmp = successor;
+	}
+
+	augment->propagate(tmp, NULL);
+	return rebalance;
+}
+
+static void dummy_propagate(struct rb_node *node, struct rb_node *stop)
+{
+	UNUSED(node);
+	UNUSED(stop);
+}
+
+static void dummy_copy(struct rb_node *old, struct rb_node *new)
+{
+	UNUSED(old);
+	UNUSED(new);
+}
+
+static void dummy_rotate(struct rb_node *old, struct rb_node *new)
+{
+	UNUSED(old);
+	UNUSED(new);
+}
+
+static const struct rb_augment_callbacks dummy_callbacks = {
+	.propagate = dummy_propagate,
+	.copy = dummy_copy,
+	.rotate = dummy_rotate,
+};
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root)
+{
+	rb_insert_fixup(node, root, dummy_rotate);
+}
+
+void rb_erase(struct rb_node *node, struct rb_root *root)
+{
+	struct rb_node *rebalance = rb_erase_node(node, root, &dummy_callbacks);
+	if (rebalance)
+		rb_erase_fixup(rebalance, root, dummy_rotate);
+}
+
+void rb_insert_augmented(struct rb_node *node, struct rb_root *root,
+			 const struct rb_augment_callbacks *augment)
+{
+	rb_insert_fixup(node, root, augment->rotate);
+}
+
+void rb_erase_augmented(struct rb_node *node, struct rb_root *root,
+			const struct rb_augment_callbacks *augment)
+{
+	struct rb_node *rebalance = rb_erase_node(node, root, augment);
+	if (rebalance)
+		rb_erase_fixup(rebalance, root, augment->rotate);
+}
+
+struct rb_node *rb_first(const struct rb_root *root)
+{
+	struct rb_node *n = root->rb_node;
+	if (!n)
+		return NULL;
+	while (n->rb_left)
+		n = n->rb_left;
+	return n;
+}
+
+struct rb_node *rb_last(const struct rb_root *root)
+{
+	struct rb_node *n = root->rb_node;
+	if (!n)
+		return NULL;
+	while (n->rb_right)
+		n = n->rb_right;
+	return n;
+}
+
+struct rb_node *rb_next(const struct rb_node *node)
+{
+	struct rb_node *parent;
+
+	if (RB_EMPTY_NODE(node))
+		return NULL;
+
+	/* leftmost node of the right subtree */
+	if (node->rb_right) {
+		node = node->rb_right;
+		while (node->rb_left)
+			node = node->rb_left;
+		return (struct rb_node *)node;
+	}
+
+	/* else the first ancestor we reach from its left subtree */
+	while ((parent = rb_parent(node)) && node == parent->rb_right)
+		node = parent;
+	return parent;
+}
+
+struct rb_node *rb_prev(const struct rb_node *node)
+{
+	struct rb_node *parent;
+
+	if (RB_EMPTY_NODE(node))
+		return NULL;
+
+	if (node->rb_left) {
+		node = node->rb_left;
+		while (node->rb_right)
+			node = node->rb_right;
+		return (struct rb_node *)node;
+	}
+
+	while ((parent = rb_parent(node)) && node == parent->rb_left)
+		node = parent;
+	return parent;
+}
@@ -6,7 +6,10 @@
 #include <misc/logger.h>
 #include <mm/bitmap.h>
 #include <mm/heap.h>
+#include <mm/shrinker.h>
 #include <mm/slab.h>
+#include <mm/tlb.h>
+#include <mm/vmalloc.h>
 #include <mm/vma.h>
 #include <mm/vmm.h>
 #include <printf.h>
@@ -18,6 +21,183 @@ extern terminal_t g_terminal;
 
 static mm_struct *g_test_mm = NULL;
 
+/* Print slow / fast as a speedup factor */
+static void print_speedup(u64 slow, u64 fast)
+{
+	/* scale down so the ratio fits 32-bit arithmetic */
+	while (slow >= (1ULL << 24) || fast >= (1ULL << 24)) {
+		slow >>= 1;
+		fast >>= 1;
+	}
+	u32 ratio = fast ? (u32)(slow * 100) / (u32)fast : 0;
+	printf("  speedup: %u.%02ux\n", ratio / 100, ratio % 100);
+}
+
+/* TSC cycles for iterations full-screen clears */
+static u64 fb_bench_run(u32 iterations)
+{
+	u64 start = rdtsc();
+	for (u32 i = 0; i < iterations; i++)
+		vbe_clear_screen((i & 1) ? VBE_COLOR_BLACK
+					 : VBE_COLOR_DARK_GRAY);
+	return rdtsc() - start;
+}
+
+/* Time framebuffer clears uncached and write-combining */
+static void fb_bench(u32 iterations)
+{
+	if (!vbe_is_available()) {
+		printf("No framebuffer available.\n");
+		return;
+	}
+	vbe_device_t *dev = vbe_get_device();
+	u32 fb = dev->framebuffer_addr;
+	u32 size = dev->framebuffer_size;
+	/* change the memory type over the whole mapping, so a 4 MiB page
+	 * is retyped in place instead of being split
+	 */
+	u32 map_size = vmm_fb_map_size();
+	if (!map_size)
+		map_size = size;
+
+	vmm_set_cache_attr(fb, map_size, PAGE_FLAG_UC);
+	u64 uc = fb_bench_run(iterations);
+	u64 wc = 0;
+	if (vmm_pat_enabled()) {
+		vmm_set_cache_attr(fb, map_size, PAGE_FLAG_WC);
+		wc = fb_bench_run(iterations);
+	} else {
+		vmm_set_cache_attr(fb, map_size, 0);
+	}
+	vbe_clear_screen(VBE_COLOR_BLACK);
+
+	printf("%u clears of %u KiB\n", iterations, size / 1024);
+	printf("  UC: %llu cycles\n", uc);
+	if (!wc) {
+		printf("  WC: unavailable (no PAT)\n");
+		return;
+	}
+	printf("  WC: %llu cycles\n", wc);
+	print_speedup(uc, wc);
+}
+
+/* Read the first word of every object, rounds times */
+static u64 slab_bench_run(void **objs, u32 count, u32 rounds)
+{
+	u32 sum = 0;
+	u64 start = rdtsc();
+	for (u32 r = 0; r < rounds; r++)
+		for (u32 i = 0; i < count; i++)
+			sum += *(volatile u32 *)objs[i];
+	UNUSED(sum);
+	return rdtsc() - start;
+}
+
+/* Time walks over the objects of nr_slabs slabs, first without and then
+ * with slab colouring. A 3712-byte object fills a one page slab and leaves
+ * 384 bytes of slack: uncoloured, every object starts at page offset 0 and
+ * all of them compete for the same cache sets.
+ */
+static void slab_bench(u32 nr_slabs)
+{
+	static const u32 flags[2] = {SLAB_FLAGS_NO_COLOUR, SLAB_FLAGS_NONE};
+	static const char *const names[2] = {"bench-plain", "bench-colour"};
+	u64 cycles[2] = {0, 0};
+	u32 colours[2] = {0, 0};
+	u32 count = 0;
+
+	for (u32 k = 0; k < 2; k++) {
+		struct kmem_cache *cache
+			= kmem_cache_create(names[k], 3712, 64, flags[k], NULL);
+		if (!cache) {
+			printf("Failed to create benchmark cache\n");
+			return;
+		}
+		colours[k] = cache->colour;
+		count = nr_slabs * cache->objects_per_slab;
+
+		void **objs = kmalloc(count * sizeof(void *));
+		if (objs && kmem_cache_alloc_bulk(cache, count, objs)) {
+			slab_bench_run(objs, count, 1);
+			cycles[k] = slab_bench_run(objs, count, 1000);
+			kmem_cache_free_bulk(cache, count, objs);
+		}
+		kfree(objs);
+		kmem_cache_destroy(cache);
+	}
+
+	if (!cycles[0] || !cycles[1]) {
+		printf("Out of memory\n");
+		return;
+	}
+	printf("1000 walks over %u objects in %u slabs\n", count, nr_slabs);
+	printf("  plain:     %llu cycles (%u colour)\n", cycles[0],
+	       colours[0]);
+	printf("  coloured:  %llu cycles (%u colours)\n", cycles[1],
+	       colours[1]);
+	print_speedup(cycles[0], cycles[1]);
+}
+
+#define VMA_BENCH_NR 512
+#define VMA_BENCH_BASE 0x40000000UL
+
+/* faults lookups that stay on one VMA for 16 faults before moving on */
+static u64 vma_bench_run(mm_struct *mm, u32 faults, bool flush)
+{
+	u32 found = 0;
+	u64 start = rdtsc();
+	for (u32 k = 0; k < faults; k++) {
+		u32 idx = (k / 16) % VMA_BENCH_NR;
+		unsigned long addr = VMA_BENCH_BASE + idx * 5 * PAGE_SIZE
+				     + (k % 4) * PAGE_SIZE;
+		if (flush)
+			vmacache_flush(mm);
+		found += find_vma(mm, addr) != NULL;
+	}
+	UNUSED(found);
+	return rdtsc() - start;
+}
+
+/* Time find_vma under a synthetic fault storm over VMA_BENCH_NR four page
+ * VMAs, first with the VMA cache flushed before every lookup, then with
+ * the cache at work.
+ */
+static void vma_bench(u32 faults)
+{
+	mm_struct *mm = mm_create();
+	if (!mm) {
+		printf("Out of memory\n");
+		return;
+	}
+	for (u32 i = 0; i < VMA_BENCH_NR; i++) {
+		if (mmap_anonymous(mm, VMA_BENCH_BASE + i * 5 * PAGE_SIZE,
+				   4 * PAGE_SIZE, VM_READ, NULL)
+		    != KERNEL_OK) {
+			printf("Failed to set up VMA %u\n", i);
+			mm_destroy(mm);
+			return;
+		}
+	}
+
+	u64 cycles[2];
+	u32 hits[2], misses[2];
+	for (u32 k = 0; k < 2; k++) {
+		mm->vmacache_hits = 0;
+		mm->vmacache_misses = 0;
+		cycles[k] = vma_bench_run(mm, faults, k == 0);
+		hits[k] = mm->vmacache_hits;
+		misses[k] = mm->vmacache_misses;
+	}
+	mm_destroy(mm);
+
+	printf("%u lookups over %u VMAs\n", faults, VMA_BENCH_NR);
+	printf("  flushed:   %llu cycles (%u hits, %u misses)\n", cycles[0],
+	       hits[0], misses[0]);
+	printf("  vmacache:  %llu cycles (%u hits, %u misses)\n", cycles[1],
+	       hits[1], misses[1]);
+	print_speedup(cycles[0], cycles[1]);
+}
+
 static char *readline(char *buf, size_t buf_size)
 {
 	size_t i = 0;
@@ -81,9 +261,14 @@ void shell_start(void)
             printf("  help          - Display this help message\n");
             printf("  echo <text>   - Print the provided text\n");
             printf("  clear         - Clear the screen\n");
+            printf("  fb_bench [n]  - Time n screen clears uncached vs write-combining\n");
             printf("  heap_info     - Display heap total and free size\n");
+            printf("  heap_trim     - Return free heap pages to the PMM\n");
+            printf("  vmalloc_info  - Display kernel VA arena usage\n");
             printf("  pmm_info      - Display physical memory total and free pages\n");
-            printf("  alloc_page    - Allocate a physical page and print address\n");
+            printf("  reclaim_info  - Show watermarks, shrinkers and reclaim counters\n");
+            printf("  reclaim <pages> - Run the shrinkers to free the given number of pages\n");
+            printf("  alloc_page [dma|high] - Allocate a physical page and print address\n");
             printf("  free_page <hex_addr> - Free a physical page at the given address\n");
             printf("  kmalloc <size> - Allocate heap memory of given size and print pointer\n");
             printf("  kfree <hex_ptr> - Free heap memory at the given pointer\n");
@@ -94,10 +279,13 @@ void shell_start(void)
             printf("  slab_alloc <name> - Allocate an object from the cache\n");
             printf("  slab_free <name> <hex_ptr> - Free an object back to the cache\n");
             printf("  slab_info <name> - Display cache statistics\n");
+            printf("  slab_bench [n] - Time object walks over n slabs with and without colouring\n");
             printf("  vma_mmap <addr_hex> <len_decimal> <flags_decimal> - Map anonymous VMA\n");
             printf("  vma_munmap <addr_hex> <len_decimal> - Unmap VMA range\n");
             printf("  vma_info      - Display current VMAs in test address space\n");
             printf("  vma_destroy   - Destroy test VMA address space\n");
+            printf("  vma_bench [n] - Time n find_vma lookups with and without the VMA cache\n");
+            printf("  tlb_info [threshold] - Show TLB flush stats, optionally set the full flush threshold\n");
             printf("  initrd_info   - Show initrd presence and size\n");
             printf("  initrd_ls     - List files in initrd tar archive\n");
             printf("  initrd_cat <path> - Print a file from initrd\n");
@@ -110,11 +298,73 @@ void shell_start(void)
 		} else if (strcmp(cmd, "clear") == 0) {
 			vbe_clear_screen(VBE_COLOR_BLACK);
 
+		} else if (strcmp(cmd, "fb_bench") == 0) {
+			char *arg = strtok(NULL, " ");
+			u32 iterations = arg ? (u32)atoi(arg) : 10;
+			fb_bench(iterations ? iterations : 1);
+
 		} else if (strcmp(cmd, "heap_info") == 0) {
 			size_t total = heap_get_total_size();
 			size_t free = heap_get_free_size();
 			printf("Heap Total: %zu bytes, Free: %zu bytes\n",
 			       total, free);
+			heap_stats_t hs;
+			heap_get_stats(&hs);
+			printf("krealloc: %u in place, %u moved\n",
+			       hs.realloc_inplace, hs.realloc_moved);
+			printf("Trimmed: %u pages\n", hs.trimmed_pages);
+
+		} else if (strcmp(cmd, "heap_trim") == 0) {
+			size_t released = heap_trim();
+			printf("Released %zu bytes to the PMM\n", released);
+
+		} else if (strcmp(cmd, "vmalloc_info") == 0) {
+			vmalloc_stats_t vs;
+			vmalloc_get_stats(&vs);
+			printf("Arena 0x%x-0x%x\n", VMALLOC_START, VMALLOC_END);
+			printf("Free: %u KiB in %u ranges, largest %u KiB\n",
+			       vs.free_bytes / 1024, vs.nr_free,
+			       vs.largest_free / 1024);
+			printf("Used: %u KiB in %u areas, %u vmalloc pages\n",
+			       vs.used_bytes / 1024, vs.nr_busy,
+			       vs.vmalloc_pages);
+			printf("Reserved: %u KiB\n", vs.reserved_bytes / 1024);
+
+		} else if (strcmp(cmd, "reclaim_info") == 0) {
+			printf("Free pages: %u (min %u, low %u, high %u)\n",
+			       pmm_get_free_pages(),
+			       g_physical_allocator.wmark_min,
+			       g_physical_allocator.wmark_low,
+			       g_physical_allocator.wmark_high);
+			printf("Refused at min: %u\n",
+			       g_physical_allocator.wmark_failures);
+			reclaim_stats_t rs;
+			reclaim_get_stats(&rs);
+			printf("Low wakeups: %u, background runs: %u, direct "
+			       "runs: %u, failed: %u\n",
+			       rs.low_wakeups, rs.balance_runs, rs.direct_runs,
+			       rs.failed_runs);
+			printf("Pages reclaimed: %u\n", rs.pages_reclaimed);
+			struct shrinker *shrinker;
+			list_for_each_entry(shrinker, &shrinker_list, list)
+			{
+				printf("  %-8s reclaimable ~%u pages, %u calls, "
+				       "%u pages freed\n",
+				       shrinker->name,
+				       shrinker->count ? shrinker->count(shrinker)
+						       : 0,
+				       shrinker->nr_calls,
+				       shrinker->nr_reclaimed);
+			}
+
+		} else if (strcmp(cmd, "reclaim") == 0) {
+			char *arg = strtok(NULL, " ");
+			if (!arg) {
+				printf("Usage: reclaim <pages>\n");
+			} else {
+				u32 freed = shrink_memory((u32)atoi(arg));
+				printf("Reclaimed %u pages\n", freed);
+			}
 
 		} else if (strcmp(cmd, "pmm_info") == 0) {
 			u32 total_pages = pmm_get_total_pages();
@@ -122,9 +372,27 @@ void shell_start(void)
 			printf("Physical Memory Total Pages: %u, Free Pages: "
 			       "%u\n",
 			       total_pages, free_pages);
+			for (u32 z = 0; z < MAX_NR_ZONES; z++) {
+				printf("  Zone %-8s managed: %u, free: %u\n",
+				       g_zones[z].name,
+				       g_zones[z].managed_pages,
+				       pmm_get_zone_free_pages(z));
+			}
+			zero_pool_stats_t zs;
+			pmm_zero_pool_stats(&zs);
+			printf("Zero pool: %u/%u ready, hits: %u, misses: %u, "
+			       "refilled: %u\n",
+			       zs.count, zs.capacity, zs.hits, zs.misses,
+			       zs.refilled);
 
 		} else if (strcmp(cmd, "alloc_page") == 0) {
-			u32 addr = pmm_alloc_page();
+			char *arg = strtok(NULL, " ");
+			u32 flags = PMM_ZONE_NORMAL;
+			if (arg && strcmp(arg, "dma") == 0)
+				flags = PMM_ZONE_DMA;
+			else if (arg && strcmp(arg, "high") == 0)
+				flags = PMM_ZONE_HIGH;
+			u32 addr = pmm_alloc_page(flags);
 			if (addr != 0) {
 				printf("Allocated physical page at 0x%x\n",
 				       addr);
@@ -260,6 +528,15 @@ void shell_start(void)
 
 		} else if (strcmp(cmd, "vma_info") == 0) {
 			dump_mmap(g_test_mm);
+			if (g_test_mm)
+				printf("VMA cache: %u hits, %u misses\n",
+				       g_test_mm->vmacache_hits,
+				       g_test_mm->vmacache_misses);
+
+		} else if (strcmp(cmd, "vma_bench") == 0) {
+			char *arg = strtok(NULL, " ");
+			u32 faults = arg ? (u32)atoi(arg) : 100000;
+			vma_bench(faults ? faults : 1);
 
 		} else if (strcmp(cmd, "vma_destroy") == 0) {
 			if (g_test_mm) {
@@ -270,6 +547,18 @@ void shell_start(void)
 				printf("No test VMA address space active.\n");
 			}
 
+		} else if (strcmp(cmd, "tlb_info") == 0) {
+			char *arg = strtok(NULL, " ");
+			if (arg)
+				tlb_flush_threshold = atoi(arg);
+			tlb_stats_t ts;
+			tlb_get_stats(&ts);
+			printf("TLB full flush threshold: %u pages\n",
+			       tlb_flush_threshold);
+			printf("Flushes: %u invlpg, %u full, frames freed: %u\n",
+			       ts.invlpg_flushes, ts.full_flushes,
+			       ts.frames_freed);
+
 		} else if (strcmp(cmd, "slab_create") == 0) {
 			char *name = strtok(NULL, " ");
 			char *size_str = strtok(NULL, " ");
@@ -361,15 +650,32 @@ void shell_start(void)
 					= find_cache_by_name(name);
 				if (cache) {
 					u32 full_slabs = 0, partial_slabs = 0,
-					    free_slabs = 0;
-					struct list_head *pos;
-					list_for_each(pos, &cache->slabs_full)
+					    free_slabs = 0, inuse = 0;
+					struct slab *slab;
+					list_for_each_entry(slab,
+							    &cache->slabs_full,
+							    list)
 						full_slabs++;
-					list_for_each(pos,
-						      &cache->slabs_partial)
+					list_for_each_entry(
+						slab, &cache->slabs_partial,
+						list)
+					{
 						partial_slabs++;
-					list_for_each(pos, &cache->slabs_free)
+						inuse += slab->inuse;
+					}
+					list_for_each_entry(slab,
+							    &cache->slabs_free,
+							    list)
 						free_slabs++;
+					u32 nr_slabs = full_slabs
+						       + partial_slabs
+						       + free_slabs;
+					inuse += full_slabs
+						 * cache->objects_per_slab;
+					/* magazine objects are free */
+					for (u32 cpu = 0; cpu < NR_CPUS; cpu++)
+						inuse -= cache->cpu_cache[cpu]
+								 .avail;
 
 					printf("Slab cache '%s': obj_size=%u, "
 					       "objs_per_slab=%u\n",
@@ -379,6 +685,40 @@ void shell_start(void)
 					       "free=%u\n",
 					       full_slabs, partial_slabs,
 					       free_slabs);
+
+					/* internal fragmentation: bytes of
+					 * each slab no object can use
+					 */
+					u32 slab_bytes = PAGE_SIZE
+							 << cache->order;
+					u32 waste = slab_bytes
+						    - cache->objects_per_slab
+							      * cache->object_size;
+					printf("Layout: %u pages per slab, "
+					       "%s descriptor\n",
+					       1u << cache->order,
+					       cache->off_slab ? "off-slab"
+							       : "on-slab");
+					printf("Unused per slab: %u of %u "
+					       "bytes (%u.%u%%)\n",
+					       waste, slab_bytes,
+					       waste * 100 / slab_bytes,
+					       waste * 1000 / slab_bytes % 10);
+					printf("Objects: %u in use of %u\n",
+					       inuse, nr_slabs
+							      * cache->objects_per_slab);
+
+					struct array_cache *ac
+						= &cache->cpu_cache
+							   [smp_processor_id()];
+					printf("Magazine: %u/%u objects, "
+					       "batch=%u\n",
+					       ac->avail, ac->limit,
+					       ac->batchcount);
+					printf("Alloc hit/miss=%u/%u, "
+					       "free hit/miss=%u/%u\n",
+					       ac->allochit, ac->allocmiss,
+					       ac->freehit, ac->freemiss);
 				} else {
 					printf("Slab cache '%s' not found\n",
 					       name);
@@ -387,6 +727,11 @@ void shell_start(void)
 				printf("Usage: slab_info <name>\n");
 			}
 
+		} else if (strcmp(cmd, "slab_bench") == 0) {
+			char *arg = strtok(NULL, " ");
+			u32 nr_slabs = arg ? (u32)atoi(arg) : 256;
+			slab_bench(nr_slabs ? nr_slabs : 1);
+
 		} else if (strcmp(cmd, "initrd_info") == 0) {
 			void *data = initrd_get_data();
 			uint32_t size = initrd_get_size();
@@ -3,74 +3,76 @@
 #include <kernel/kernel.h>
 #include <misc/logger.h>
 #include <mm/bitmap.h>
+#include <mm/buddy.h>
+#include <mm/page.h>
+#include <mm/shrinker.h>
 #include <printf.h>
 #include <string.h>
 
 bitmap_allocator_t g_physical_allocator = {0};
 
+#define BITS_PER_WORD 32
+
+/*
+ * The bitmap no longer drives allocation; the buddy allocator does. It is
+ * kept as a per-page shadow of the allocation state so that double frees
+ * and buddy corruption are caught when a page changes hands.
+ */
+
 /* Set a bit in the physical allocation bitmap (no counters here) */
 static void bitmap_set_bit(u32 bit)
 {
-	if (bit / 8 >= g_physical_allocator.size)
+	u32 word = bit / BITS_PER_WORD;
+	if (word >= g_physical_allocator.words)
 		return;
-	g_physical_allocator.bits[bit / 8] |= (1 << (bit % 8));
+	g_physical_allocator.bits[word] |= (1u << (bit % BITS_PER_WORD));
 }
 
 /* Clear a bit in the physical allocation bitmap (no counters here) */
 static void bitmap_clear_bit(u32 bit)
 {
-	if (bit / 8 >= g_physical_allocator.size)
+	u32 word = bit / BITS_PER_WORD;
+	if (word >= g_physical_allocator.words)
 		return;
-	g_physical_allocator.bits[bit / 8] &= ~(1 << (bit % 8));
+	g_physical_allocator.bits[word] &= ~(1u << (bit % BITS_PER_WORD));
 }
 
 /* Return true if bit is set (page allocated) */
 static bool bitmap_test_bit(u32 bit)
 {
-	if (bit / 8 >= g_physical_allocator.size)
+	u32 word = bit / BITS_PER_WORD;
+	if (word >= g_physical_allocator.words)
 		return false;
-	return (g_physical_allocator.bits[bit / 8] & (1 << (bit % 8))) != 0;
+	return (g_physical_allocator.bits[word] & (1u << (bit % BITS_PER_WORD)))
+	       != 0;
 }
 
-static u32 bitmap_find_free_bit(void)
+/* Carve 'bytes' out of the PMM metadata region during pmm_init */
+static void *pmm_early_alloc(u32 bytes)
 {
-	for (u32 byte = 0; byte < g_physical_allocator.size; byte++) {
-		if (g_physical_allocator.bits[byte] != 0xFF) {
-			for (u32 bit = 0; bit < 8; bit++) {
-				if (!(g_physical_allocator.bits[byte] & (1 << bit))) {
-					return (byte * 8) + bit;
-				}
-			}
-		}
-	}
-	return (u32)-1;
+	u32 addr = g_physical_allocator.meta_start
+		   + g_physical_allocator.meta_size;
+	g_physical_allocator.meta_size += ALIGN_UP(bytes, 16);
+	return (void *)addr;
 }
 
-static u32 bitmap_find_free_bits(u32 count)
+/* Metadata goes right after the kernel image, or after the last boot
+ * module if the bootloader placed modules behind the kernel.
+ */
+static u32 pmm_metadata_base(multiboot_info_t *mb_info)
 {
-	if (count == 0)
-		return (u32)-1;
-
-	u32 found = 0;
-	for (u32 byte = 0; byte < g_physical_allocator.size; byte++) {
-		if (g_physical_allocator.bits[byte] == 0xFF) {
-			found = 0;
-			continue;
-		}
+	extern u32 _kernel_end;
+	u32 base = (u32)&_kernel_end;
 
-		for (u32 bit = 0; bit < 8; bit++) {
-			u32 idx = byte * 8 + bit;
-			if (bitmap_test_bit(idx)) {
-				found = 0;
-				continue;
-			}
-			found++;
-			if (found == count) {
-				return (byte * 8 + bit + 1 - count);
-			}
+	if (mb_info->flags & MULTIBOOT_INFO_MODS) {
+		multiboot_module_t *mod
+			= (multiboot_module_t *)mb_info->mods_addr;
+		for (u32 i = 0; i < mb_info->mods_count; i++, mod++) {
+			if (mod->mod_end > base)
+				base = mod->mod_end;
 		}
 	}
-	return (u32)-1;
+	return PAGE_ALIGN(base);
 }
 
 /* Mark a physical byte range as allocated (adjust counters safely) */
@@ -96,7 +98,7 @@ static void mark_region_allocated(u64 start, u64 len)
 }
 
 /* Mark a physical byte range as free (adjust counters safely) */
-static void __attribute__((unused)) mark_region_free(u64 start, u64 len)
+static void mark_region_free(u64 start, u64 len)
 {
 	if (len == 0)
 		return;
@@ -138,52 +140,43 @@ kernel_status_t pmm_init(multiboot_info_t *mb_info)
 	/* total managed pages */
 	g_physical_allocator.total_pages = (u32)(max_addr / PAGE_SIZE);
 
-	/* bitmap size in bytes and pages */
-	u32 bitmap_bytes = (g_physical_allocator.total_pages + 7) / 8;
-	g_physical_allocator.size = (u32)ALIGN_UP(bitmap_bytes, PAGE_SIZE);
-
 	extern u32 _kernel_end;
-	u32 bitmap_addr = PAGE_ALIGN((u32)&_kernel_end);
-	g_physical_allocator.bits = (u8 *)bitmap_addr;
+
+	/* Lay out the metadata region: bitmap words, then the page database */
+	g_physical_allocator.words
+		= (g_physical_allocator.total_pages + BITS_PER_WORD - 1)
+		  / BITS_PER_WORD;
+	g_physical_allocator.meta_start = pmm_metadata_base(mb_info);
+	g_physical_allocator.meta_size = 0;
+
+	u32 bitmap_bytes = g_physical_allocator.words * sizeof(u32);
+	g_physical_allocator.bits = pmm_early_alloc(bitmap_bytes);
+	struct page *pages = pmm_early_alloc(
+		g_physical_allocator.total_pages * sizeof(struct page));
+	g_physical_allocator.meta_size
+		= PAGE_ALIGN(g_physical_allocator.meta_size);
 
 	/* mark all pages allocated initially (we'll free the available ones) */
-	memset(g_physical_allocator.bits, 0xFF, g_physical_allocator.size);
+	memset(g_physical_allocator.bits, 0xFF, bitmap_bytes);
 	g_physical_allocator.free_pages = 0;
 	g_physical_allocator.used_pages = g_physical_allocator.total_pages;
 
-	/* Reserve low memory and the space used by the bitmap itself so clearing
-	 * available regions won't touch them.
-	 */
-	mark_region_allocated(0, 0x100000);
-	mark_region_allocated(bitmap_addr, g_physical_allocator.size);
-
-	/* Now walk the memory map and mark available pages (>= 1MB) as free,
-	 * but do not touch pages we've already reserved above.
+	/* Walk the memory map and mark available pages (>= 1MB) as free.
+	 * Everything that is in use already gets reserved again below.
 	 */
 	mmap = (multiboot_memory_map_t *)mb_info->mmap_addr;
 	while ((u32)mmap < mb_info->mmap_addr + mb_info->mmap_length) {
-		if (mmap->type == MULTIBOOT_MEMORY_AVAILABLE && mmap->addr >= 0x100000) {
-			u32 start_page = (u32)(ALIGN_UP(mmap->addr, PAGE_SIZE) / PAGE_SIZE);
-			u32 end_page = (u32)((mmap->addr + mmap->len) / PAGE_SIZE);
-			for (u32 page = start_page; page < end_page; page++) {
-				u32 page_addr = page * PAGE_SIZE;
-				/* do not free pages that belong to the bitmap area */
-				if (page_addr >= bitmap_addr
-				    && page_addr < bitmap_addr + g_physical_allocator.size) {
-					continue;
-				}
-				if (bitmap_test_bit(page)) {
-					bitmap_clear_bit(page);
-					g_physical_allocator.free_pages++;
-					if (g_physical_allocator.used_pages > 0)
-						g_physical_allocator.used_pages--;
-				}
-			}
-		}
+		if (mmap->type == MULTIBOOT_MEMORY_AVAILABLE && mmap->addr >= 0x100000)
+			mark_region_free(mmap->addr, mmap->len);
 		mmap = (multiboot_memory_map_t *)((u32)mmap + mmap->size
 						  + sizeof(mmap->size));
 	}
 
+	/* Reserve low memory and the PMM metadata itself */
+	mark_region_allocated(0, 0x100000);
+	mark_region_allocated(g_physical_allocator.meta_start,
+			      g_physical_allocator.meta_size);
+
 	/* Reserve boot/multiboot structures and modules as used */
 	mark_region_allocated((u32)mb_info, sizeof(multiboot_info_t));
 	mark_region_allocated(mb_info->mmap_addr, mb_info->mmap_length);
@@ -200,54 +193,160 @@ kernel_status_t pmm_init(multiboot_info_t *mb_info)
 	/* Reserve the kernel region itself (if not already reserved) */
 	mark_region_allocated(0x100000, (u32)&_kernel_end - 0x100000);
 
+	/* Hand every page still free in the bitmap to the buddy allocator;
+	 * everything else stays PG_RESERVED in the page database.
+	 */
+	page_db_init(pages, g_physical_allocator.total_pages);
+	buddy_init(g_physical_allocator.total_pages);
+	u32 run_start = 0, run_len = 0;
+	for (u32 page = 0; page < g_physical_allocator.total_pages; page++) {
+		if (!bitmap_test_bit(page)) {
+			mem_map[page].flags &= ~PG_RESERVED;
+			pfn_to_zone(page)->managed_pages++;
+			if (run_len++ == 0)
+				run_start = page;
+			continue;
+		}
+		if (run_len)
+			buddy_free_range(run_start, run_len);
+		run_len = 0;
+	}
+	if (run_len)
+		buddy_free_range(run_start, run_len);
+
+	/* min is 1/256 of free memory within [16, 1024] pages; low and high
+	 * sit 25% and 50% above it
+	 */
+	u32 wmark_min = MAX(MIN(g_physical_allocator.free_pages / 256, 1024u),
+			    16u);
+	g_physical_allocator.wmark_min = wmark_min;
+	g_physical_allocator.wmark_low = wmark_min + wmark_min / 4;
+	g_physical_allocator.wmark_high = wmark_min + wmark_min / 2;
+
 	log(LOG_OKAY, "PMM initialized: %u total pages, %u free pages",
 	    g_physical_allocator.total_pages, g_physical_allocator.free_pages);
+	log(LOG_INFO, "PMM: watermarks min %u, low %u, high %u pages",
+	    g_physical_allocator.wmark_min, g_physical_allocator.wmark_low,
+	    g_physical_allocator.wmark_high);
+	for (u32 z = 0; z < MAX_NR_ZONES; z++) {
+		log(LOG_INFO, "PMM: zone %s: pfn 0x%x-0x%x, %u free pages",
+		    g_zones[z].name, g_zones[z].start_pfn, g_zones[z].end_pfn,
+		    g_zones[z].free_pages);
+	}
 	return KERNEL_OK;
 }
 
-u32 pmm_alloc_page(void)
+/* Allocate a buddy block from the first zone in the fallback order for
+ * flags that can satisfy it. DMA requests never leave the DMA zone, and
+ * the DMA zone is always the last resort for everybody else.
+ */
+static u32 pmm_zone_alloc(u32 order, u32 flags)
 {
-	if (g_physical_allocator.free_pages == 0) {
-		return 0;
+	static const zone_type_t dma_zones[] = {ZONE_DMA, MAX_NR_ZONES};
+	static const zone_type_t normal_zones[]
+		= {ZONE_NORMAL, ZONE_DMA, MAX_NR_ZONES};
+	static const zone_type_t high_zones[]
+		= {ZONE_HIGH, ZONE_NORMAL, ZONE_DMA, MAX_NR_ZONES};
+
+	const zone_type_t *zones = normal_zones;
+	if (flags & PMM_ZONE_DMA)
+		zones = dma_zones;
+	else if (flags & PMM_ZONE_HIGH)
+		zones = high_zones;
+
+	for (; *zones != MAX_NR_ZONES; zones++) {
+		u32 pfn = buddy_alloc(&g_zones[*zones], order);
+		if (pfn != BUDDY_NONE)
+			return pfn;
 	}
-	u32 bit = bitmap_find_free_bit();
-	if (bit == (u32)-1) {
-		return 0;
+	return BUDDY_NONE;
+}
+
+/* Record a buddy allocation in the bitmap shadow. Returns false (and leaves
+ * the bitmap alone) if a page of the block is already marked allocated,
+ * which means the buddy free lists are corrupted.
+ */
+static bool pmm_commit_pages(u32 pfn, u32 count)
+{
+	for (u32 i = 0; i < count; i++) {
+		if (bitmap_test_bit(pfn + i)) {
+			log(LOG_ERR, "PMM: buddy returned allocated page 0x%x",
+			    (pfn + i) * PAGE_SIZE);
+			return false;
+		}
+	}
+	for (u32 i = 0; i < count; i++) {
+		struct page *page = pfn_to_page(pfn + i);
+		bitmap_set_bit(pfn + i);
+		page->flags = 0;
+		page->refcount = 1;
+		page->owner = NULL;
+	}
+	g_physical_allocator.free_pages -= count;
+	g_physical_allocator.used_pages += count;
+	return true;
+}
+
+/* Check a request of count pages against the watermarks. Fails below min
+ * unless the request may use the reserve, and wakes up reclaim once free
+ * memory drops below low.
+ */
+static bool pmm_watermark_ok(u32 count, u32 flags)
+{
+	u32 free = g_physical_allocator.free_pages;
+	if (free < count)
+		return false;
+	if (free - count < g_physical_allocator.wmark_min
+	    && !(flags & PMM_ALLOC_RESERVE)) {
+		g_physical_allocator.wmark_failures++;
+		reclaim_wakeup();
+		return false;
 	}
-	bitmap_set_bit(bit);
-	g_physical_allocator.free_pages--;
-	g_physical_allocator.used_pages++;
-	return bit * PAGE_SIZE;
+	if (free - count < g_physical_allocator.wmark_low)
+		reclaim_wakeup();
+	return true;
 }
 
-u32 pmm_alloc_pages(u32 count)
+u32 pmm_alloc_order(u32 order, u32 flags)
 {
-	if (g_physical_allocator.free_pages < count) {
+	if (order > BUDDY_MAX_ORDER || !pmm_watermark_ok(1u << order, flags)) {
 		return 0;
 	}
-	u32 start_bit = bitmap_find_free_bits(count);
-	if (start_bit == (u32)-1) {
+	u32 pfn = pmm_zone_alloc(order, flags);
+	if (pfn == BUDDY_NONE) {
 		return 0;
 	}
-	for (u32 i = 0; i < count; i++) {
-		bitmap_set_bit(start_bit + i);
+	if (!pmm_commit_pages(pfn, 1u << order)) {
+		return 0;
 	}
-	g_physical_allocator.free_pages -= count;
-	g_physical_allocator.used_pages += count;
-	return start_bit * PAGE_SIZE;
+	return pfn * PAGE_SIZE;
 }
 
-void pmm_free_page(u32 addr)
+u32 pmm_alloc_page(u32 flags)
 {
-	if (addr == 0)
-		return;
-	u32 bit = addr / PAGE_SIZE;
-	if (bitmap_test_bit(bit)) {
-		bitmap_clear_bit(bit);
-		g_physical_allocator.free_pages++;
-		if (g_physical_allocator.used_pages > 0)
-			g_physical_allocator.used_pages--;
+	return pmm_alloc_order(0, flags);
+}
+
+u32 pmm_alloc_pages(u32 count, u32 flags)
+{
+	if (count == 0 || !pmm_watermark_ok(count, flags)) {
+		return 0;
+	}
+	u32 order = buddy_order_for(count);
+	if (order > BUDDY_MAX_ORDER) {
+		return 0;
+	}
+	u32 pfn = pmm_zone_alloc(order, flags);
+	if (pfn == BUDDY_NONE) {
+		return 0;
 	}
+	/* give the unused tail of the power-of-two block straight back */
+	if ((1u << order) > count)
+		buddy_free_range(pfn + count, (1u << order) - count);
+	if (!pmm_commit_pages(pfn, count)) {
+		return 0;
+	}
+	return pfn * PAGE_SIZE;
 }
 
 void pmm_free_pages(u32 addr, u32 count)
@@ -255,16 +354,53 @@ void pmm_free_pages(u32 addr, u32 count)
 	if (addr == 0 || count == 0)
 		return;
 
+	/* Free maximal runs of pages the bitmap agrees are allocated; pages
+	 * that are already free or reserved are reported instead of
+	 * corrupting the buddy lists.
+	 */
 	u32 start_bit = addr / PAGE_SIZE;
+	u32 run_start = start_bit, run_len = 0;
 	for (u32 i = 0; i < count; i++) {
 		u32 bit = start_bit + i;
-		if (bitmap_test_bit(bit)) {
+		struct page *page = phys_to_page(bit * PAGE_SIZE);
+		if (page && !(page->flags & PG_RESERVED)
+		    && bitmap_test_bit(bit)) {
 			bitmap_clear_bit(bit);
-			g_physical_allocator.free_pages++;
-			if (g_physical_allocator.used_pages > 0)
-				g_physical_allocator.used_pages--;
+			page->flags = 0;
+			page->refcount = 0;
+			page->owner = NULL;
+			if (run_len++ == 0)
+				run_start = bit;
+			continue;
 		}
+		if (page && (page->flags & PG_RESERVED))
+			log(LOG_WARN, "PMM: refusing to free reserved page 0x%x",
+			    bit * PAGE_SIZE);
+		else
+			log(LOG_WARN, "PMM: double free of page 0x%x",
+			    bit * PAGE_SIZE);
+		if (run_len)
+			buddy_free_range(run_start, run_len);
+		g_physical_allocator.free_pages += run_len;
+		g_physical_allocator.used_pages -= run_len;
+		run_len = 0;
 	}
+	if (run_len)
+		buddy_free_range(run_start, run_len);
+	g_physical_allocator.free_pages += run_len;
+	g_physical_allocator.used_pages -= run_len;
+}
+
+void pmm_free_page(u32 addr)
+{
+	pmm_free_pages(addr, 1);
+}
+
+void pmm_free_order(u32 addr, u32 order)
+{
+	if (order > BUDDY_MAX_ORDER)
+		return;
+	pmm_free_pages(addr, 1u << order);
 }
 
 u32 pmm_get_total_pages(void)
@@ -275,4 +411,11 @@ u32 pmm_get_total_pages(void)
 u32 pmm_get_free_pages(void)
 {
 	return g_physical_allocator.free_pages;
-}
\ No newline at end of file
+}
+
+u32 pmm_get_zone_free_pages(zone_type_t zone)
+{
+	if (zone >= MAX_NR_ZONES)
+		return 0;
+	return g_zones[zone].free_pages;
+}
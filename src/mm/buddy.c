@@ -0,0 +1,141 @@
+#include <kernel/kernel.h>
+#include <mm/buddy.h>
+#include <mm/page.h>
+
+struct zone g_zones[MAX_NR_ZONES] = {
+	[ZONE_DMA] = {.name = "DMA"},
+	[ZONE_NORMAL] = {.name = "Normal"},
+	[ZONE_HIGH] = {.name = "HighMem"},
+};
+
+/* Unlink the free block headed by page from its order list */
+static void buddy_list_del(struct zone *zone, struct page *page, u32 order)
+{
+	list_del_init(&page->list);
+	page->flags &= ~PG_BUDDY;
+
+	if (--zone->nr_free[order] == 0)
+		zone->free_mask &= ~(1u << order);
+}
+
+/* Push the block headed by page on its order list */
+static void buddy_list_add(struct zone *zone, struct page *page, u32 order)
+{
+	page->flags |= PG_BUDDY;
+	page->private = order;
+	list_add(&page->list, &zone->free_area[order]);
+
+	zone->nr_free[order]++;
+	zone->free_mask |= 1u << order;
+}
+
+void buddy_init(u32 total_pages)
+{
+	static const u32 zone_end[MAX_NR_ZONES] = {
+		[ZONE_DMA] = ZONE_DMA_END_PFN,
+		[ZONE_NORMAL] = ZONE_NORMAL_END_PFN,
+		[ZONE_HIGH] = 0xFFFFFFFFu,
+	};
+	u32 start = 0;
+
+	for (u32 z = 0; z < MAX_NR_ZONES; z++) {
+		struct zone *zone = &g_zones[z];
+		u32 end = MIN(zone_end[z], total_pages);
+
+		zone->start_pfn = MIN(start, end);
+		zone->end_pfn = end;
+		zone->free_mask = 0;
+		zone->free_pages = 0;
+		zone->managed_pages = 0;
+		for (u32 order = 0; order <= BUDDY_MAX_ORDER; order++) {
+			INIT_LIST_HEAD(&zone->free_area[order]);
+			zone->nr_free[order] = 0;
+		}
+		start = end;
+	}
+}
+
+struct zone *pfn_to_zone(u32 pfn)
+{
+	if (pfn < ZONE_DMA_END_PFN)
+		return &g_zones[ZONE_DMA];
+	if (pfn < ZONE_NORMAL_END_PFN)
+		return &g_zones[ZONE_NORMAL];
+	return &g_zones[ZONE_HIGH];
+}
+
+u32 buddy_order_for(u32 count)
+{
+	u32 order = 0;
+	while ((1u << order) < count && order <= BUDDY_MAX_ORDER)
+		order++;
+	return order;
+}
+
+u32 buddy_alloc(struct zone *zone, u32 order)
+{
+	if (order > BUDDY_MAX_ORDER)
+		return BUDDY_NONE;
+
+	/* smallest non-empty order that can satisfy the request */
+	u32 avail = zone->free_mask & ~((1u << order) - 1);
+	if (!avail)
+		return BUDDY_NONE;
+	u32 cur = __builtin_ctz(avail);
+
+	struct page *page = list_first_entry(&zone->free_area[cur],
+					     struct page, list);
+	u32 pfn = page_to_pfn(page);
+	buddy_list_del(zone, page, cur);
+
+	/* split, returning the upper halves to the lower order lists */
+	while (cur > order) {
+		cur--;
+		buddy_list_add(zone, pfn_to_page(pfn + (1u << cur)), cur);
+	}
+
+	zone->free_pages -= 1u << order;
+	return pfn;
+}
+
+void buddy_free(u32 pfn, u32 order)
+{
+	struct zone *zone = pfn_to_zone(pfn);
+
+	if (pfn >= zone->end_pfn || order > BUDDY_MAX_ORDER)
+		return;
+
+	zone->free_pages += 1u << order;
+
+	/* coalesce with free buddies of the same order */
+	while (order < BUDDY_MAX_ORDER) {
+		u32 buddy = pfn ^ (1u << order);
+		if (buddy >= zone->end_pfn)
+			break;
+		struct page *page = pfn_to_page(buddy);
+		if (!(page->flags & PG_BUDDY) || page->private != order)
+			break;
+		buddy_list_del(zone, page, order);
+		pfn &= ~(1u << order);
+		order++;
+	}
+
+	buddy_list_add(zone, pfn_to_page(pfn), order);
+}
+
+void buddy_free_range(u32 pfn, u32 count)
+{
+	u32 end = pfn + count;
+
+	while (pfn < end) {
+		/* largest aligned block starting at pfn that fits the range */
+		u32 order = pfn ? (u32)__builtin_ctz(pfn) : BUDDY_MAX_ORDER;
+		if (order > BUDDY_MAX_ORDER)
+			order = BUDDY_MAX_ORDER;
+		while ((1u << order) > end - pfn)
+			order--;
+
+		buddy_free(pfn, order);
+		pfn += 1u << order;
+	}
+}
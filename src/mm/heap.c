@@ -1,186 +1,596 @@
 #include <kernel/kernel.h>
+#include <misc/list.h>
 #include <misc/logger.h>
 #include <mm/bitmap.h>
+#include <mm/buddy.h>
 #include <mm/heap.h>
+#include <mm/page.h>
+#include <mm/shrinker.h>
+#include <mm/slab.h>
+#include <mm/vmalloc.h>
 #include <mm/vmm.h>
 #include <string.h>
 
+/*
+ * Segregated-fit kernel heap.
+ *
+ * The heap is one virtually contiguous range [HEAP_START, heap_current_end)
+ * cut into blocks. Each block starts with a 16-byte header that holds its own
+ * payload size and the payload size of the block before it (a boundary tag),
+ * so both neighbours are found in O(1) and kfree coalesces immediately.
+ * Zero-sized fencepost blocks at both ends of the range keep coalescing
+ * inside the heap.
+ *
+ * Free memory is given back to the PMM by heap_trim(): a free tail moves
+ * heap_current_end down, and whole free pages inside other free blocks are
+ * unmapped while the block keeps its address range (HEAP_BLOCK_TRIMMED).
+ * Such pages are mapped again when the block is handed out.
+ *
+ * Aligned allocations take a larger block and split off the gap in front
+ * of the aligned address as a free block of its own, so the padding is not
+ * lost.
+ *
+ * The heap window is reserved in the kernel VA arena (mm/vmalloc.h).
+ * Requests of KMALLOC_VMALLOC_MIN bytes or more skip the heap and are
+ * served by vmalloc(), so big buffers need no contiguous heap range and
+ * their address space is reused once they are freed.
+ *
+ * Free blocks sit on HEAP_NR_BINS lists: bin n holds payload sizes in
+ * [16 << n, 32 << n). Bit n of heap_bin_mask is set while bin n is
+ * non-empty. An allocation is a find-first-set over the bins whose blocks
+ * all fit the request, followed by a list pop.
+ */
 struct heap_block {
-	struct heap_block *next;
-	struct heap_block *prev;
-	size_t size;
-	bool free;
+	u32 size;		/* payload bytes, a multiple of HEAP_MIN_ALIGN */
+	u32 prev_size;		/* payload bytes of the preceding block */
 	u32 magic;
+	u32 flags;		/* HEAP_BLOCK_* */
+};
+
+/* Free blocks keep their bin linkage at the start of the payload */
+struct heap_free_block {
+	struct heap_block hdr;
+	struct list_head link;
 };
 
 #define HEAP_MAGIC 0xDEADBEEF
 #define HEAP_START 0xD0000000
+#define HEAP_END 0xE0000000
 #define INITIAL_HEAP_SIZE (4 * 1024 * 1024)
-#define HEAP_ALIGN(size) ALIGN_UP(size, 4)
+#define HEAP_MIN_ALIGN KMALLOC_MIN_ALIGN
+#define HEAP_ALIGN(size) ALIGN_UP(size, HEAP_MIN_ALIGN)
+#define HEAP_HDR ((u32)sizeof(struct heap_block))
+#define HEAP_NR_BINS 24		/* covers the 256 MiB heap window */
+
+#define HEAP_BLOCK_FREE (1 << 0)
+#define HEAP_BLOCK_FENCE (1 << 1)
+#define HEAP_BLOCK_TRIMMED (1 << 2)	/* payload pages may be unmapped */
 
-static struct heap_block *heap_head = NULL;
+/* kmalloc sends requests of this size and up to vmalloc */
+#define KMALLOC_VMALLOC_MIN (256 * 1024)
+
+/* kfree trims free runs of at least this size right away */
+#define HEAP_TRIM_THRESHOLD (256 * 1024)
+/* the tail is never trimmed below the initial heap */
+#define HEAP_TRIM_FLOOR (HEAP_START + INITIAL_HEAP_SIZE)
+
+static struct list_head heap_bins[HEAP_NR_BINS];
+static u32 heap_bin_mask = 0;
 static u32 heap_current_end = HEAP_START;
+static size_t heap_free_bytes = 0;
+static heap_stats_t heap_stats;
 
-/* Expand the heap area by at least the given size in bytes */
-static kernel_status_t heap_expand(size_t additional_size)
+static inline struct heap_block *block_next(struct heap_block *block)
 {
-	additional_size = PAGE_ALIGN(additional_size + sizeof(struct heap_block));
-	u32 num_pages = additional_size / PAGE_SIZE;
+	return (struct heap_block *)((u8 *)block + HEAP_HDR + block->size);
+}
 
-	log(LOG_INFO, "Expanding heap by %u bytes (%u pages) at 0x%x",
-	    additional_size, num_pages, heap_current_end);
+static inline struct heap_block *block_prev(struct heap_block *block)
+{
+	return (struct heap_block *)((u8 *)block - block->prev_size
+				     - HEAP_HDR);
+}
 
-	for (int retry = 0; retry < 3; ++retry) {
-		u32 phys_addr = pmm_alloc_pages(num_pages);
-		if (phys_addr == 0) {
-			log(LOG_WARN, "Heap expand retry %d/%d failed (OOM)", retry + 1, 3);
+static inline void *block_payload(struct heap_block *block)
+{
+	return (u8 *)block + HEAP_HDR;
+}
+
+static inline bool heap_contains(const void *ptr)
+{
+	return (u32)ptr >= HEAP_START && (u32)ptr < HEAP_END;
+}
+
+/* Header of a kmalloc'ed pointer, or NULL if ptr cannot be one */
+static struct heap_block *heap_lookup(void *ptr, const char *who)
+{
+	u32 addr = (u32)ptr;
+	if (addr < HEAP_START + 2 * HEAP_HDR || addr >= heap_current_end
+	    || (addr & (HEAP_MIN_ALIGN - 1))) {
+		log(LOG_ERR, "%s: 0x%x is not a heap pointer", who, addr);
+		return NULL;
+	}
+
+	struct heap_block *block = (struct heap_block *)(addr - HEAP_HDR);
+	if (block->magic != HEAP_MAGIC) {
+		log(LOG_ERR,
+		    "Heap corruption: bad magic 0x%x at block 0x%x (user ptr "
+		    "0x%x)",
+		    block->magic, (u32)block, addr);
+		return NULL;
+	}
+	if (block->flags & HEAP_BLOCK_FREE) {
+		log(LOG_ERR,
+		    "Double free detected: block at 0x%x (user ptr 0x%x) "
+		    "already free",
+		    (u32)block, addr);
+		return NULL;
+	}
+	if (block->flags & HEAP_BLOCK_FENCE) {
+		log(LOG_ERR, "%s: 0x%x is a heap fencepost", who, addr);
+		return NULL;
+	}
+	return block;
+}
+
+/* Bin a free block of this payload size belongs to */
+static u32 heap_bin_index(u32 size)
+{
+	u32 bin = 31 - __builtin_clz(size) - 4;
+	return MIN(bin, HEAP_NR_BINS - 1);
+}
+
+static void heap_bin_insert(struct heap_block *block)
+{
+	struct heap_free_block *fb = (struct heap_free_block *)block;
+	u32 bin = heap_bin_index(block->size);
+
+	block->flags |= HEAP_BLOCK_FREE;
+	list_add(&fb->link, &heap_bins[bin]);
+	heap_bin_mask |= 1u << bin;
+	heap_free_bytes += block->size;
+}
+
+static void heap_bin_remove(struct heap_block *block)
+{
+	struct heap_free_block *fb = (struct heap_free_block *)block;
+	u32 bin = heap_bin_index(block->size);
+
+	block->flags &= ~HEAP_BLOCK_FREE;
+	list_del(&fb->link);
+	if (list_empty(&heap_bins[bin]))
+		heap_bin_mask &= ~(1u << bin);
+	heap_free_bytes -= block->size;
+}
+
+/* Find a free block with at least size payload bytes */
+static struct heap_block *heap_find_block(u32 size)
+{
+	u32 bin = heap_bin_index(size);
+
+	/* any block in a bin above the request's bin is large enough; the
+	 * request's own bin only if size is the bin's lower bound
+	 */
+	u32 first = (size == (u32)HEAP_MIN_ALIGN << bin) ? bin : bin + 1;
+	u32 avail = first < HEAP_NR_BINS ? heap_bin_mask & ~((1u << first) - 1)
+					 : 0;
+	if (avail) {
+		struct heap_free_block *fb = list_first_entry(
+			&heap_bins[__builtin_ctz(avail)],
+			struct heap_free_block, link);
+		return &fb->hdr;
+	}
+
+	/* last resort: first fit inside the request's own bin */
+	struct heap_free_block *fb;
+	list_for_each_entry(fb, &heap_bins[bin], link)
+	{
+		if (fb->hdr.size >= size)
+			return &fb->hdr;
+	}
+	return NULL;
+}
+
+/* Merge a block that is no longer in use with its free neighbours and put
+ * the result on its bin. Returns the merged block.
+ */
+static struct heap_block *heap_release_block(struct heap_block *block)
+{
+	struct heap_block *next = block_next(block);
+	if (next->flags & HEAP_BLOCK_FREE) {
+		heap_bin_remove(next);
+		block->size += HEAP_HDR + next->size;
+		block->flags |= next->flags & HEAP_BLOCK_TRIMMED;
+		next->magic = 0;
+	}
+
+	struct heap_block *prev = block_prev(block);
+	if (prev->flags & HEAP_BLOCK_FREE) {
+		heap_bin_remove(prev);
+		prev->size += HEAP_HDR + block->size;
+		prev->flags |= block->flags & HEAP_BLOCK_TRIMMED;
+		block->magic = 0;
+		block = prev;
+	}
+
+	block_next(block)->prev_size = block->size;
+	heap_bin_insert(block);
+	return block;
+}
+
+/* Shrink an in-use block to size bytes and free the tail if it can hold a
+ * block of its own.
+ */
+static void heap_split_block(struct heap_block *block, u32 size)
+{
+	if (block->size < size + HEAP_HDR + HEAP_MIN_ALIGN)
+		return;
+
+	u8 *payload = block_payload(block);
+	struct heap_block *rest = (struct heap_block *)(payload + size);
+	rest->size = block->size - size - HEAP_HDR;
+	rest->prev_size = size;
+	rest->magic = HEAP_MAGIC;
+	rest->flags = block->flags & HEAP_BLOCK_TRIMMED;
+	block_next(rest)->prev_size = rest->size;
+	block->size = size;
+
+	heap_release_block(rest);
+}
+
+/* Unmap [virt, virt + num_pages * PAGE_SIZE) and give the frames back,
+ * one physically contiguous run at a time. Holes are skipped. Returns the
+ * number of pages released.
+ */
+static u32 heap_unmap_region(u32 virt, u32 num_pages)
+{
+	u32 released = 0;
+	u32 i = 0;
+
+	while (i < num_pages) {
+		u32 va = virt + i * PAGE_SIZE;
+		u32 phys = vmm_get_physical_addr(va);
+		if (phys == 0) {
+			i++;
 			continue;
 		}
 
-		kernel_status_t status = vmm_map_pages(
-			heap_current_end, phys_addr, num_pages,
-			PAGE_FLAG_PRESENT | PAGE_FLAG_RW);
+		u32 run = 1;
+		while (i + run < num_pages
+		       && vmm_get_physical_addr(va + run * PAGE_SIZE)
+				  == phys + run * PAGE_SIZE)
+			run++;
 
-		if (status != KERNEL_OK) {
-			log(LOG_ERR, "Heap expand: vmm_map_pages failed (%d) at 0x%x",
-			    status, heap_current_end);
-			pmm_free_pages(phys_addr, num_pages);
-			continue;
+		vmm_unmap_pages(va, run);
+		pmm_free_pages(phys, run);
+		released += run;
+		i += run;
+	}
+	return released;
+}
+
+/* Back [virt, virt + num_pages * PAGE_SIZE) with physical memory. The heap
+ * only needs virtual contiguity, so the range is filled from buddy blocks of
+ * at most 2^BUDDY_MAX_ORDER pages. On failure everything is rolled back.
+ */
+static kernel_status_t heap_map_region(u32 virt, u32 num_pages)
+{
+	u32 mapped = 0;
+	kernel_status_t status = KERNEL_OK;
+
+	while (mapped < num_pages) {
+		u32 chunk = MIN(num_pages - mapped, 1u << BUDDY_MAX_ORDER);
+		u32 phys_addr = pmm_alloc_pages(chunk, PMM_ZONE_HIGH);
+		if (phys_addr == 0) {
+			status = KERNEL_OUT_OF_MEMORY;
+			break;
 		}
 
-		struct heap_block *new_block = (struct heap_block *)heap_current_end;
-		memset(new_block, 0, additional_size);
-
-		new_block->size  = additional_size - sizeof(struct heap_block);
-		new_block->free  = true;
-		new_block->next  = NULL;
-		new_block->prev  = NULL;
-		new_block->magic = HEAP_MAGIC;
-
-		log(LOG_INFO, "Heap: new block at 0x%x, usable size %u bytes",
-		    (u32)new_block, new_block->size);
-
-		if (heap_head == NULL) {
-			heap_head = new_block;
-		} else {
-			struct heap_block *last = heap_head;
-			while (last->next) last = last->next;
-			last->next = new_block;
-			new_block->prev = last;
+		status = vmm_map_pages(virt + mapped * PAGE_SIZE, phys_addr,
+				       chunk, PAGE_FLAGS_KERNEL);
+		if (status != KERNEL_OK) {
+			pmm_free_pages(phys_addr, chunk);
+			break;
 		}
+		for (u32 i = 0; i < chunk; i++)
+			page_set_owner(phys_addr + i * PAGE_SIZE, PG_HEAP, NULL);
+		mapped += chunk;
+	}
+
+	if (status != KERNEL_OK)
+		heap_unmap_region(virt, mapped);
+	return status;
+}
 
-		heap_current_end += additional_size;
-		return KERNEL_OK;
+/* Map whatever is missing in [start, end) after trimming */
+static bool heap_populate(u32 start, u32 end)
+{
+	for (u32 va = ALIGN_DOWN(start, PAGE_SIZE); va < end; va += PAGE_SIZE) {
+		if (vmm_get_physical_addr(va))
+			continue;
+		if (heap_map_region(va, 1) != KERNEL_OK)
+			return false;
 	}
+	return true;
+}
+
+/* Make sure the first bytes of a (possibly trimmed) free block are backed:
+ * need bytes of payload plus room for the header and bin link of a block
+ * split off behind them. need counts from the start of the payload, so it
+ * includes any alignment gap.
+ */
+static bool heap_populate_block(struct heap_block *block, u32 need)
+{
+	if (!(block->flags & HEAP_BLOCK_TRIMMED))
+		return true;
 
-	log(LOG_ERR, "Heap expansion failed after 3 retries");
-	return KERNEL_OUT_OF_MEMORY;
-}
-
-/* Try to merge adjacent free blocks */
-static void heap_defragment(void)
-{
-	struct heap_block *current = heap_head;
-	while (current != NULL && current->next != NULL) {
-		if (current->free && current->next->free
-		    && current->magic == HEAP_MAGIC
-		    && current->next->magic == HEAP_MAGIC) {
-			current->size += sizeof(struct heap_block)
-					 + current->next->size;
-			current->next = current->next->next;
-			if (current->next)
-				current->next->prev = current;
-		} else {
-			current = current->next;
+	u32 start = (u32)block_payload(block);
+	u32 end = MIN(start + need + HEAP_HDR + sizeof(struct list_head),
+		      (u32)block_next(block));
+	return heap_populate(start, end);
+}
+
+/* Expand the heap area by at least the given size in bytes of payload */
+static kernel_status_t heap_expand(size_t additional_size)
+{
+	/* the old end fencepost turns into the new block's header and a new
+	 * fencepost goes at the end; the very first expansion also needs the
+	 * start fencepost
+	 */
+	u32 overhead = heap_current_end == HEAP_START ? 3 * HEAP_HDR : HEAP_HDR;
+	additional_size = PAGE_ALIGN(additional_size + overhead);
+	u32 num_pages = additional_size / PAGE_SIZE;
+
+	if (additional_size > HEAP_END - heap_current_end) {
+		log(LOG_ERR, "Heap expand: no address space left at 0x%x",
+		    heap_current_end);
+		return KERNEL_OUT_OF_MEMORY;
+	}
+
+	log(LOG_INFO, "Expanding heap by %u bytes (%u pages) at 0x%x",
+	    additional_size, num_pages, heap_current_end);
+
+	/* an empty PMM gets one round of reclaim before the expand fails */
+	kernel_status_t status = heap_map_region(heap_current_end, num_pages);
+	if (status == KERNEL_OUT_OF_MEMORY && shrink_memory(num_pages))
+		status = heap_map_region(heap_current_end, num_pages);
+	if (status != KERNEL_OK) {
+		log(LOG_ERR, "Heap expand: mapping %u pages at 0x%x failed (%d)",
+		    num_pages, heap_current_end, status);
+		return status;
+	}
+
+	/* Only headers need initializing; callers that want zeroed memory
+	 * use kcalloc, which clears what it hands out.
+	 */
+	struct heap_block *block;
+	if (heap_current_end == HEAP_START) {
+		struct heap_block *fence = (struct heap_block *)HEAP_START;
+		fence->size = 0;
+		fence->prev_size = 0;
+		fence->magic = HEAP_MAGIC;
+		fence->flags = HEAP_BLOCK_FENCE;
+		block = block_next(fence);
+		block->prev_size = 0;
+	} else {
+		block = (struct heap_block *)(heap_current_end - HEAP_HDR);
+	}
+
+	u32 new_end = heap_current_end + additional_size;
+	struct heap_block *fence = (struct heap_block *)(new_end - HEAP_HDR);
+	block->size = (u32)fence - (u32)block - HEAP_HDR;
+	block->magic = HEAP_MAGIC;
+	block->flags = 0;
+	fence->size = 0;
+	fence->prev_size = block->size;
+	fence->magic = HEAP_MAGIC;
+	fence->flags = HEAP_BLOCK_FENCE;
+	heap_current_end = new_end;
+
+	block = heap_release_block(block);
+	log(LOG_INFO, "Heap: free block at 0x%x, usable size %u bytes",
+	    (u32)block, block->size);
+	return KERNEL_OK;
+}
+
+/* Unmap the whole pages inside a free block, leaving its header and bin
+ * link alone. Only runs of at least min_bytes are released.
+ */
+static u32 heap_trim_block(struct heap_block *block, u32 min_bytes)
+{
+	u32 start = PAGE_ALIGN((u32)block_payload(block)
+			       + sizeof(struct list_head));
+	u32 end = ALIGN_DOWN((u32)block_next(block), PAGE_SIZE);
+	if (end <= start || end - start < min_bytes)
+		return 0;
+
+	block->flags |= HEAP_BLOCK_TRIMMED;
+	return heap_unmap_region(start, (end - start) / PAGE_SIZE);
+}
+
+/* Shrink the heap if it ends in a free block */
+static u32 heap_trim_tail(void)
+{
+	struct heap_block *fence
+		= (struct heap_block *)(heap_current_end - HEAP_HDR);
+	struct heap_block *block = block_prev(fence);
+	if (!(block->flags & HEAP_BLOCK_FREE))
+		return 0;
+
+	/* keep a minimal block and room for the new end fencepost */
+	u32 new_end = PAGE_ALIGN((u32)block_payload(block) + HEAP_MIN_ALIGN
+				 + HEAP_HDR);
+	new_end = MAX(new_end, HEAP_TRIM_FLOOR);
+	if (new_end >= heap_current_end)
+		return 0;
+	if (!heap_populate(new_end - HEAP_HDR, new_end))
+		return 0;
+
+	u32 old_end = heap_current_end;
+	heap_bin_remove(block);
+	fence = (struct heap_block *)(new_end - HEAP_HDR);
+	block->size = (u32)fence - (u32)block_payload(block);
+	fence->size = 0;
+	fence->prev_size = block->size;
+	fence->magic = HEAP_MAGIC;
+	fence->flags = HEAP_BLOCK_FENCE;
+	heap_current_end = new_end;
+	heap_bin_insert(block);
+
+	return heap_unmap_region(new_end, (old_end - new_end) / PAGE_SIZE);
+}
+
+size_t heap_trim(void)
+{
+	u32 pages = heap_trim_tail();
+
+	for (u32 bin = 0; bin < HEAP_NR_BINS; bin++) {
+		struct heap_free_block *fb;
+		list_for_each_entry(fb, &heap_bins[bin], link)
+		{
+			pages += heap_trim_block(&fb->hdr, PAGE_SIZE);
 		}
 	}
+
+	heap_stats.trimmed_pages += pages;
+	if (pages)
+		log(LOG_INFO, "Heap: trimmed %u pages, end now 0x%x", pages,
+		    heap_current_end);
+	return (size_t)pages * PAGE_SIZE;
+}
+
+/* Memory pressure: give free heap pages back, see heap_trim() */
+static u32 heap_shrink_count(struct shrinker *shrinker)
+{
+	/* an upper bound: trimmed blocks count as free but hold no pages */
+	return heap_free_bytes / PAGE_SIZE;
 }
 
+static u32 heap_shrink_scan(struct shrinker *shrinker, u32 nr_pages)
+{
+	return heap_trim() / PAGE_SIZE;
+}
+
+static struct shrinker heap_shrinker = {
+	.name = "heap",
+	.count = heap_shrink_count,
+	.scan = heap_shrink_scan,
+};
+
 kernel_status_t heap_init(void)
 {
-	heap_head = NULL;
+	for (u32 i = 0; i < HEAP_NR_BINS; i++)
+		INIT_LIST_HEAD(&heap_bins[i]);
+	heap_bin_mask = 0;
+	heap_free_bytes = 0;
 	heap_current_end = HEAP_START;
+	kernel_status_t status = vmap_reserve(HEAP_START, HEAP_END - HEAP_START);
+	if (status != KERNEL_OK)
+		return status;
+	register_shrinker(&heap_shrinker);
 	return heap_expand(INITIAL_HEAP_SIZE);
 }
 
+/* Take need payload bytes at an align-aligned address from the heap */
+static void *heap_alloc(u32 need, u32 align)
+{
+	/* worst case the aligned address is align + HEAP_MIN_ALIGN bytes
+	 * into the block, see below
+	 */
+	u32 search = align > HEAP_MIN_ALIGN ? need + align + HEAP_MIN_ALIGN
+					    : need;
+	struct heap_block *block = heap_find_block(search);
+	if (block == NULL) {
+		kernel_status_t status = heap_expand(search);
+		if (status != KERNEL_OK) {
+			log(LOG_ERR, "Heap expansion failed, status: %d",
+			    status);
+			return NULL;
+		}
+		block = heap_find_block(search);
+		if (block == NULL)
+			return NULL;
+	}
+
+	/* a gap in front of the aligned address has to hold a free block */
+	u32 start = (u32)block_payload(block);
+	u32 addr = ALIGN_UP(start, align);
+	if (addr != start && addr - start < HEAP_HDR + HEAP_MIN_ALIGN)
+		addr += align;
+
+	if (!heap_populate_block(block, addr - start + need))
+		return NULL;
+	heap_bin_remove(block);
+
+	if (addr != start) {
+		struct heap_block *gap = block;
+		block = (struct heap_block *)(addr - HEAP_HDR);
+		block->size = gap->size - (addr - start);
+		block->prev_size = addr - HEAP_HDR - start;
+		block->magic = HEAP_MAGIC;
+		block->flags = gap->flags & HEAP_BLOCK_TRIMMED;
+		block_next(block)->prev_size = block->size;
+		gap->size = block->prev_size;
+		heap_release_block(gap);
+	}
+
+	heap_split_block(block, need);
+	block->flags &= ~HEAP_BLOCK_TRIMMED;
+	return block_payload(block);
+}
+
 void *kmalloc(size_t size)
 {
 	if (size == 0) {
 		log(LOG_WARN, "kmalloc called with size 0, returning NULL");
 		return NULL;
 	}
+	if (size >= KMALLOC_VMALLOC_MIN)
+		return vmalloc(size);
 
-	struct heap_block *current = heap_head;
-	while (current != NULL) {
-		if (current->free && current->size >= size
-		    && current->magic == HEAP_MAGIC) {
-			if (current->size > size + sizeof(struct heap_block)) {
-				struct heap_block *new_block
-					= (struct heap_block
-						   *)((u8 *)current
-						      + sizeof(
-							      struct heap_block)
-						      + size);
-				new_block->next = current->next;
-				new_block->prev = current;
-				new_block->size = current->size - size
-						  - sizeof(struct heap_block);
-				new_block->free = true;
-				new_block->magic = HEAP_MAGIC;
-				current->next = new_block;
-				if (new_block->next) {
-					new_block->next->prev = new_block;
-				}
-				current->size = size;
-			}
-
-			current->free = false;
-			return (void *)((u8 *)current
-					+ sizeof(struct heap_block));
-		}
-		current = current->next;
-	}
+	/* small objects come from the kmalloc-N slab caches */
+	struct kmem_cache *cache = kmalloc_slab(size);
+	if (cache)
+		return kmem_cache_alloc(cache);
 
-	heap_defragment();
-
-	current = heap_head;
-	while (current != NULL) {
-		if (current->free && current->size >= size
-		    && current->magic == HEAP_MAGIC) {
-			if (current->size > size + sizeof(struct heap_block)) {
-				struct heap_block *new_block
-					= (struct heap_block
-						   *)((u8 *)current
-						      + sizeof(
-							      struct heap_block)
-						      + size);
-				new_block->next = current->next;
-				new_block->prev = current;
-				new_block->size = current->size - size
-						  - sizeof(struct heap_block);
-				new_block->free = true;
-				new_block->magic = HEAP_MAGIC;
-				current->next = new_block;
-				if (new_block->next) {
-					new_block->next->prev = new_block;
-				}
-				current->size = size;
-			}
-
-			current->free = false;
-			return (void *)((u8 *)current
-					+ sizeof(struct heap_block));
-		}
-		current = current->next;
-	}
+	return heap_alloc(HEAP_ALIGN(size), HEAP_MIN_ALIGN);
+}
 
-	kernel_status_t status = heap_expand(size + sizeof(struct heap_block));
-	if (status != KERNEL_OK) {
-		log(LOG_ERR, "Heap expansion failed, status: %d", status);
+void *kmalloc_aligned(size_t size, size_t align)
+{
+	if (size == 0 || align == 0 || (align & (align - 1))) {
+		log(LOG_WARN, "kmalloc_aligned: bad size %u or alignment %u",
+		    size, align);
 		return NULL;
 	}
+	if (align <= HEAP_MIN_ALIGN)
+		return kmalloc(size);
+	/* vmalloc areas are page aligned */
+	if (size >= KMALLOC_VMALLOC_MIN && align <= PAGE_SIZE)
+		return vmalloc(size);
+	if (size > HEAP_END - HEAP_START || align > HEAP_END - HEAP_START)
+		return NULL;
+
+	/* kmalloc-N objects are aligned to N */
+	struct kmem_cache *cache = kmalloc_slab(MAX(size, align));
+	if (cache)
+		return kmem_cache_alloc(cache);
 
-	return kmalloc(size);
+	return heap_alloc(HEAP_ALIGN(size), align);
+}
+
+void *kmalloc_flags(size_t size, u32 flags)
+{
+	size_t align = HEAP_MIN_ALIGN;
+	if (flags & KMALLOC_PAGE)
+		align = PAGE_SIZE;
+	else if (flags & KMALLOC_ALIGN64)
+		align = KMALLOC_CACHE_LINE;
+
+	void *ptr = kmalloc_aligned(size, align);
+	if (ptr != NULL && (flags & KMALLOC_ZERO))
+		memset(ptr, 0, size);
+	return ptr;
 }
 
 void *kcalloc(size_t num, size_t size)
@@ -190,11 +600,44 @@ void *kcalloc(size_t num, size_t size)
 		return NULL;
 	}
 
-	void *ptr = kmalloc(total_size);
-	if (ptr != NULL) {
-		memset(ptr, 0, total_size);
+	return kmalloc_flags(total_size, KMALLOC_ZERO);
+}
+
+/* Resize a heap block without moving it: shrink by splitting off the tail,
+ * grow into a free successor, growing the heap first if the block is the
+ * last one. Returns false if the block has to move.
+ */
+static bool heap_resize_block(void *ptr, size_t new_size)
+{
+	struct heap_block *block = (struct heap_block *)((u8 *)ptr - HEAP_HDR);
+	if (new_size > HEAP_END - HEAP_START)
+		return false;
+	u32 need = HEAP_ALIGN(new_size);
+
+	if (need > block->size) {
+		struct heap_block *next = block_next(block);
+		if ((next->flags & HEAP_BLOCK_FENCE)
+		    && heap_expand(need - block->size) == KERNEL_OK)
+			next = block_next(block);
+		if (!(next->flags & HEAP_BLOCK_FREE)
+		    || block->size + HEAP_HDR + next->size < need)
+			return false;
+		u32 extra = need - block->size;
+		if (!heap_populate_block(next, extra > HEAP_HDR
+							? extra - HEAP_HDR
+							: 0))
+			return false;
+
+		heap_bin_remove(next);
+		block->size += HEAP_HDR + next->size;
+		block->flags |= next->flags & HEAP_BLOCK_TRIMMED;
+		next->magic = 0;
+		block_next(block)->prev_size = block->size;
 	}
-	return ptr;
+
+	heap_split_block(block, need);
+	block->flags &= ~HEAP_BLOCK_TRIMMED;
+	return true;
 }
 
 void *krealloc(void *ptr, size_t new_size)
@@ -208,49 +651,60 @@ void *krealloc(void *ptr, size_t new_size)
 		return NULL;
 	}
 
-	struct heap_block *block
-		= (struct heap_block *)((u8 *)ptr - sizeof(struct heap_block));
-	if (block->magic != HEAP_MAGIC || block->free) {
-		log(LOG_ERR, "krealloc invalid block at 0x%x", (u32)block);
+	size_t old_size = ksize(ptr);
+	if (old_size == 0) {
 		return NULL;
 	}
+	if (heap_contains(ptr) ? heap_resize_block(ptr, new_size)
+			       : new_size <= old_size) {
+		heap_stats.realloc_inplace++;
+		return ptr;
+	}
 
 	void *new_ptr = kmalloc(new_size);
 	if (new_ptr == NULL) {
 		return NULL;
 	}
 
-	size_t copy_size = MIN(block->size, new_size);
+	size_t copy_size = MIN(old_size, new_size);
 	memcpy(new_ptr, ptr, copy_size);
 	kfree(ptr);
+	heap_stats.realloc_moved++;
 
 	return new_ptr;
 }
 
-size_t heap_get_total_size(void)
+size_t ksize(const void *ptr)
 {
-	size_t total = 0;
-	struct heap_block *current = heap_head;
-	while (current != NULL) {
-		total += current->size + sizeof(struct heap_block);
-		current = current->next;
+	if (ptr == NULL)
+		return 0;
+
+	if (heap_contains(ptr)) {
+		struct heap_block *block = heap_lookup((void *)ptr, "ksize");
+		return block ? block->size : 0;
 	}
+
+	struct kmem_cache *cache = slab_obj_cache(ptr);
+	return cache ? cache->object_size : vmalloc_size(ptr);
+}
+
+void heap_get_stats(heap_stats_t *stats)
+{
+	if (stats)
+		*stats = heap_stats;
+}
+
+size_t heap_get_total_size(void)
+{
+	size_t total = heap_current_end - HEAP_START;
 	log(LOG_INFO, "Total heap size: %u bytes", total);
 	return total;
 }
 
 size_t heap_get_free_size(void)
 {
-	size_t free_size = 0;
-	struct heap_block *current = heap_head;
-	while (current != NULL) {
-		if (current->free) {
-			free_size += current->size;
-		}
-		current = current->next;
-	}
-	log(LOG_INFO, "Free heap size: %u bytes", free_size);
-	return free_size;
+	log(LOG_INFO, "Free heap size: %u bytes", heap_free_bytes);
+	return heap_free_bytes;
 }
 
 void kfree(void *ptr)
@@ -259,40 +713,28 @@ void kfree(void *ptr)
 		return;
 	}
 
-	struct heap_block *block
-		= (struct heap_block *)((u8 *)ptr - sizeof(struct heap_block));
-
-	if (block->magic != HEAP_MAGIC) {
-		log(LOG_ERR, "Heap corruption: bad magic 0x%x at block 0x%x (user ptr 0x%x)",
-		      block->magic, (u32)block, (u32)ptr);
-	}
-
-	if (block->free) {
-		log(LOG_ERR, "Double free detected: block at 0x%x (user ptr 0x%x) already free",
-		      (u32)block, (u32)ptr);
+	if (!heap_contains(ptr)) {
+		struct kmem_cache *cache = slab_obj_cache(ptr);
+		if (cache)
+			kmem_cache_free(cache, ptr);
+		else if (is_vmalloc_addr(ptr))
+			vfree(ptr);
+		else
+			log(LOG_ERR, "kfree: 0x%x is not a kmalloc pointer",
+			    (u32)ptr);
+		return;
 	}
 
-	block->free = true;
-
-	/* Merge with next free block */
-	if (block->next && block->next->free && block->next->magic == HEAP_MAGIC) {
-		block->size += sizeof(struct heap_block) + block->next->size;
-		block->next = block->next->next;
-		if (block->next) {
-			block->next->prev = block;
-		}
-		log(LOG_INFO, "Heap: merged next block at 0x%x", (u32)block);
+	struct heap_block *block = heap_lookup(ptr, "kfree");
+	if (block == NULL) {
+		return;
 	}
 
-	/* Merge with previous free block (prev absorbs us) */
-	if (block->prev && block->prev->free && block->prev->magic == HEAP_MAGIC) {
-		block->prev->size += sizeof(struct heap_block) + block->size;
-		block->prev->next = block->next;
-		if (block->next) {
-			block->next->prev = block->prev;
-		}
-		log(LOG_INFO, "Heap: merged into prev block at 0x%x", (u32)block->prev);
-		/* block is now invalid - do not touch it again */
-		return;
+	block = heap_release_block(block);
+	if (block->size >= HEAP_TRIM_THRESHOLD) {
+		u32 pages = heap_trim_tail();
+		if (block->flags & HEAP_BLOCK_FREE)
+			pages += heap_trim_block(block, HEAP_TRIM_THRESHOLD);
+		heap_stats.trimmed_pages += pages;
 	}
-}
\ No newline at end of file
+}
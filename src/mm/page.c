@@ -0,0 +1,44 @@
+#include <kernel/kernel.h>
+#include <misc/logger.h>
+#include <mm/bitmap.h>
+#include <mm/page.h>
+
+struct page *mem_map = NULL;
+u32 max_pfn = 0;
+
+void page_db_init(struct page *storage, u32 nr_pages)
+{
+	mem_map = storage;
+	max_pfn = nr_pages;
+
+	for (u32 pfn = 0; pfn < nr_pages; pfn++) {
+		struct page *page = &mem_map[pfn];
+		page->flags = PG_RESERVED;
+		page->refcount = 0;
+		page->owner = NULL;
+		INIT_LIST_HEAD(&page->list);
+		page->private = 0;
+	}
+}
+
+void page_set_owner(u32 phys, u32 flags, void *owner)
+{
+	struct page *page = phys_to_page(phys);
+	if (!page)
+		return;
+	page->flags = (page->flags & PG_RESERVED) | flags;
+	page->owner = owner;
+}
+
+void put_page(struct page *page)
+{
+	if (!page)
+		return;
+	if (page->refcount == 0) {
+		log(LOG_WARN, "PAGE: put_page on free page 0x%x",
+		    page_to_phys(page));
+		return;
+	}
+	if (--page->refcount == 0)
+		pmm_free_page(page_to_phys(page));
+}
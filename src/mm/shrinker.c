@@ -0,0 +1,88 @@
+#include <kernel/kernel.h>
+#include <misc/list.h>
+#include <misc/logger.h>
+#include <mm/bitmap.h>
+#include <mm/shrinker.h>
+
+struct list_head shrinker_list = {&shrinker_list, &shrinker_list};
+
+static bool reclaim_pending;
+static bool reclaiming;
+static reclaim_stats_t reclaim_stats;
+
+void register_shrinker(struct shrinker *shrinker)
+{
+	shrinker->nr_calls = 0;
+	shrinker->nr_reclaimed = 0;
+	list_add_tail(&shrinker->list, &shrinker_list);
+}
+
+void unregister_shrinker(struct shrinker *shrinker)
+{
+	list_del(&shrinker->list);
+}
+
+/* Walk the shrinkers in registration order until nr_pages are freed */
+static u32 do_shrink(u32 nr_pages)
+{
+	/* a shrinker that frees memory must not end up in here again */
+	if (reclaiming)
+		return 0;
+	reclaiming = true;
+
+	u32 freed = 0;
+	struct shrinker *shrinker;
+	list_for_each_entry(shrinker, &shrinker_list, list)
+	{
+		if (freed >= nr_pages)
+			break;
+		if (shrinker->count && shrinker->count(shrinker) == 0)
+			continue;
+		u32 n = shrinker->scan(shrinker, nr_pages - freed);
+		shrinker->nr_calls++;
+		shrinker->nr_reclaimed += n;
+		freed += n;
+	}
+
+	reclaiming = false;
+	reclaim_stats.pages_reclaimed += freed;
+	if (freed == 0)
+		reclaim_stats.failed_runs++;
+	return freed;
+}
+
+u32 shrink_memory(u32 nr_pages)
+{
+	reclaim_stats.direct_runs++;
+	u32 freed = do_shrink(nr_pages);
+	log(LOG_INFO, "Reclaim: asked for %u pages, freed %u", nr_pages, freed);
+	return freed;
+}
+
+void reclaim_wakeup(void)
+{
+	if (reclaim_pending)
+		return;
+	reclaim_pending = true;
+	reclaim_stats.low_wakeups++;
+}
+
+void reclaim_balance(void)
+{
+	if (!reclaim_pending)
+		return;
+	reclaim_pending = false;
+
+	u32 free = pmm_get_free_pages();
+	u32 high = g_physical_allocator.wmark_high;
+	if (free >= high)
+		return;
+	reclaim_stats.balance_runs++;
+	do_shrink(high - free);
+}
+
+void reclaim_get_stats(reclaim_stats_t *stats)
+{
+	if (stats)
+		*stats = reclaim_stats;
+}
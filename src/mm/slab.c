@@ -1,81 +1,150 @@
+#include <arch/i386/cpuid.h>
 #include <assert.h>
 #include <misc/logger.h>
 #include <mm/bitmap.h>
+#include <mm/shrinker.h>
 #include <mm/slab.h>
+#include <mm/vmalloc.h>
 #include <mm/vmm.h>
 #include <string.h>
 
 /* we need these prototypes for page/phys manipulation */
-extern u32 pmm_alloc_page(void);
 extern void pmm_free_page(u32 addr);
 extern u32 vmm_get_physical_addr(u32 virt_addr);
 extern kernel_status_t vmm_unmap_page(u32 virt_addr);
 
 struct list_head kmem_caches;
 
-#define SLAB_VIRT_START 0xE0000000
-static uintptr_t next_slab_virt = SLAB_VIRT_START;
+/* colouring step, the CPU's cache line size */
+static u32 slab_line_size = KMALLOC_CACHE_LINE;
+
+static struct kmem_cache *kmalloc_caches[KMALLOC_NR_CACHES];
+static const char *const kmalloc_names[KMALLOC_NR_CACHES] = {
+	"kmalloc-16",  "kmalloc-32",  "kmalloc-64",
+	"kmalloc-128", "kmalloc-256", "kmalloc-512",
+	"kmalloc-1024", "kmalloc-2048",
+};
 
 /* Helpers */
-static inline uintptr_t page_base_from_ptr(const void *p)
+
+/* Slab an object lives in, found through the owner of its page. NULL if
+ * the page is unmapped or not a slab page.
+ */
+static inline struct slab *obj_to_slab(const void *obj)
 {
-	return (uintptr_t)p & ~(PAGE_SIZE - 1);
+	u32 phys = vmm_get_physical_addr((u32)(uintptr_t)obj);
+	struct page *page = phys ? phys_to_page(phys) : NULL;
+	if (!page || !(page->flags & PG_SLAB))
+		return NULL;
+	return page->owner;
 }
 
-static inline struct slab *obj_to_slab(void *obj)
+/* The freelist link of a free object lives at cache->free_offset */
+static inline void *get_next_free(struct kmem_cache *cache, void *obj)
 {
-	return (struct slab *)page_base_from_ptr(obj);
+	return *(void **)((u8 *)obj + cache->free_offset);
 }
 
-static inline void *get_next_free(void *obj)
+static inline void set_next_free(struct kmem_cache *cache, void *obj,
+				 void *next)
 {
-	return *(void **)obj;
+	*(void **)((u8 *)obj + cache->free_offset) = next;
 }
 
-static inline void set_next_free(void *obj, void *next)
+static inline struct array_cache *cpu_cache(struct kmem_cache *cache)
 {
-	*(void **)obj = next;
+	return &cache->cpu_cache[smp_processor_id()];
 }
 
-/* Allocate and initialize a new slab (one page) for the given cache.
+/* Release the pages backing a slab and an off-slab descriptor. The frames
+ * come from the page descriptor, so no page table walk is needed.
+ */
+static void free_slab(struct kmem_cache *cache, struct slab *slab)
+{
+	u32 nr_pages = 1u << cache->order;
+	u32 phys = page_to_phys(slab->page);
+	u32 base = (u32)(uintptr_t)slab->base;
+	vmm_unmap_pages(base, nr_pages);
+	pmm_free_pages(phys, nr_pages);
+	free_vmap_area(base);
+	if (cache->off_slab)
+		kfree(slab);
+}
+
+/* Frames for a slab. Objects are zeroed on request only, so slab pages
+ * leave the pre-zeroed pool to page tables.
+ */
+static u32 slab_alloc_frames(u32 nr_pages)
+{
+	return pmm_alloc_pages(nr_pages, PMM_ZONE_HIGH);
+}
+
+/* Allocate and initialize a new slab of 2^order pages for the given cache.
  * On success returns 0 and slab is added to cache->slabs_partial.
  */
 static int new_slab(struct kmem_cache *cache)
 {
-	uint32_t phys = pmm_alloc_page();
-	if (!phys)
-		return -1;
+	u32 nr_pages = 1u << cache->order;
+
+	/* kmalloc may itself grow a slab, so the descriptor comes first,
+	 * before this slab claims its address range
+	 */
+	struct slab *slab = NULL;
+	if (cache->off_slab) {
+		slab = kmalloc(sizeof(*slab));
+		if (!slab)
+			return -1;
+	}
 
-	uintptr_t virt = next_slab_virt;
-	next_slab_virt += PAGE_SIZE;
+	/* on an empty PMM reclaim and try once more; the new slab is not
+	 * on any list yet, so shrinking this cache cannot touch it
+	 */
+	u32 phys = slab_alloc_frames(nr_pages);
+	if (!phys && shrink_memory(nr_pages))
+		phys = slab_alloc_frames(nr_pages);
+	if (!phys) {
+		kfree(slab);
+		return -1;
+	}
 
-	int ret = vmm_map_page(virt, phys,
-			       PAGE_FLAG_PRESENT | PAGE_FLAG_RW
-				       | PAGE_FLAG_GLOBAL);
-	if (ret != 0) {
-		pmm_free_page(phys);
+	uintptr_t virt = alloc_vmap_area(nr_pages * PAGE_SIZE, PAGE_SIZE,
+					 VMAP_RAW);
+	if (!virt || vmm_map_pages(virt, phys, nr_pages, PAGE_FLAGS_KERNEL)
+			     != KERNEL_OK) {
+		if (virt)
+			free_vmap_area(virt);
+		pmm_free_pages(phys, nr_pages);
+		kfree(slab);
 		return -1;
 	}
 
-	struct slab *slab = (struct slab *)virt;
-	memset(slab, 0, sizeof(*slab));
+	if (!slab)
+		slab = (struct slab *)virt;
 
 	slab->cache = cache;
 	INIT_LIST_HEAD(&slab->list);
 	slab->inuse = 0;
-
-	/* Build free list: objects are placed after the slab struct,
-   * aligned to cache->align.
-   */
-	uintptr_t obj_off
-		= ALIGN_UP((uintptr_t)virt + sizeof(*slab), cache->align);
+	slab->page = phys_to_page(phys);
+	slab->base = (void *)virt;
+	for (u32 i = 0; i < nr_pages; i++)
+		page_set_owner(phys + i * PAGE_SIZE, PG_SLAB, slab);
+
+	/* Build free list: objects start at cache->obj_offset, after an
+	 * on-slab descriptor, moved by the colour of this slab.
+	 */
+	uintptr_t obj_off = virt + cache->obj_offset
+			    + cache->colour_next * cache->colour_off;
+	if (++cache->colour_next >= cache->colour)
+		cache->colour_next = 0;
 	void *prev = NULL;
 
 	for (uint32_t i = 0; i < cache->objects_per_slab; i++) {
-		void *obj
-			= (void *)(obj_off + (uintptr_t)i * cache->object_size);
+		void *obj = (void *)(obj_off + (uintptr_t)i * cache->slot_size);
+		/* objects stay constructed while on the freelist */
+		if (cache->ctor)
+			cache->ctor(obj);
 		/* link objects in LIFO order */
-		set_next_free(obj, prev);
+		set_next_free(cache, obj, prev);
 		prev = obj;
 	}
 
@@ -87,14 +156,274 @@ static int new_slab(struct kmem_cache *cache)
 	return 0;
 }
 
-/* Initialize the slab subsystem */
+/* Objects that fit a slab of 2^order pages, and the bytes left over
+ * (including an on-slab descriptor)
+ */
+static u32 slab_estimate(u32 order, u32 size, u32 align, bool off_slab,
+			 u32 *left_over)
+{
+	u32 bytes = PAGE_SIZE << order;
+	u32 first = off_slab ? 0 : ALIGN_UP((u32)sizeof(struct slab), align);
+	u32 num = bytes > first ? (bytes - first) / size : 0;
+
+	*left_over = bytes - num * size;
+	return num;
+}
+
+/* Pick the slab order for a cache: the first order that wastes at most an
+ * eighth of the slab, else the one that wastes the smallest fraction.
+ * Returns the objects per slab, 0 if the object does not fit at all.
+ */
+static u32 slab_calculate_order(struct kmem_cache *cache)
+{
+	u32 best_order = 0, best_left = 0, best_num = 0;
+
+	for (u32 order = 0; order <= SLAB_MAX_ORDER; order++) {
+		u32 left;
+		u32 num = slab_estimate(order, cache->slot_size, cache->align,
+					cache->off_slab, &left);
+		if (num == 0)
+			continue;
+
+		/* left / 2^order < best_left / 2^best_order */
+		if (best_num == 0 || (left << best_order) < (best_left << order)) {
+			best_order = order;
+			best_left = left;
+			best_num = num;
+		}
+		if (left * 8 <= ((u32)PAGE_SIZE << order))
+			break;
+	}
+
+	cache->order = best_order;
+	cache->objects_per_slab = best_num;
+	cache->obj_offset
+		= cache->off_slab
+			  ? 0
+			  : ALIGN_UP((u32)sizeof(struct slab), cache->align);
+
+	/* the bytes the objects leave over set the number of colours */
+	u32 slack = ((u32)PAGE_SIZE << best_order) - cache->obj_offset
+		    - best_num * cache->slot_size;
+	cache->colour_off = MAX(slab_line_size, cache->align);
+	cache->colour = (cache->flags & SLAB_FLAGS_NO_COLOUR)
+				? 1
+				: slack / cache->colour_off + 1;
+	cache->colour_next = 0;
+	return best_num;
+}
+
+/* Pop an object off a slab's freelist and requeue the slab by occupancy */
+static void *slab_get_obj(struct kmem_cache *cache, struct slab *slab)
+{
+	void *obj = slab->freelist;
+	slab->freelist = get_next_free(cache, obj);
+	slab->inuse++;
+
+	if (slab->inuse == cache->objects_per_slab)
+		list_move_tail(&slab->list, &cache->slabs_full);
+	else if (slab->inuse == 1)
+		list_move_tail(&slab->list, &cache->slabs_partial);
+	return obj;
+}
+
+/* Put a slab on the list matching its occupancy */
+static void slab_requeue(struct kmem_cache *cache, struct slab *slab)
+{
+	struct list_head *head;
+	if (slab->inuse == cache->objects_per_slab)
+		head = &cache->slabs_full;
+	else if (slab->inuse)
+		head = &cache->slabs_partial;
+	else
+		head = &cache->slabs_free;
+	list_move_tail(&slab->list, head);
+}
+
+/* Prepare an object for handing out. Objects are already constructed;
+ * zeroing one means running the constructor again.
+ */
+static void slab_init_obj(struct kmem_cache *cache, void *obj, bool zero)
+{
+	if (!zero)
+		return;
+	memset(obj, 0, cache->object_size);
+	if (cache->ctor)
+		cache->ctor(obj);
+}
+
+/* Push an object back on its slab's freelist and requeue the slab */
+static void slab_put_obj(struct kmem_cache *cache, void *obj)
+{
+	struct slab *slab = obj_to_slab(obj);
+	if (slab->inuse == 0) {
+		log(LOG_WARN, "SLAB: double free detected for cache '%s'",
+		    cache->name);
+		return;
+	}
+
+	set_next_free(cache, obj, slab->freelist);
+	slab->freelist = obj;
+	slab->inuse--;
+
+	if (slab->inuse == 0)
+		list_move_tail(&slab->list, &cache->slabs_free);
+	else if (slab->inuse == cache->objects_per_slab - 1)
+		list_move_tail(&slab->list, &cache->slabs_partial);
+}
+
+/* Fill an empty magazine with up to batchcount objects, growing the cache
+ * if the slab lists run dry. Returns the number of objects loaded.
+ */
+static u32 cache_refill(struct kmem_cache *cache, struct array_cache *ac)
+{
+	while (ac->avail < ac->batchcount) {
+		struct list_head *slab_list = !list_empty(&cache->slabs_partial)
+						      ? &cache->slabs_partial
+						      : &cache->slabs_free;
+		if (list_empty(slab_list)) {
+			if (new_slab(cache) != 0)
+				break;
+			slab_list = &cache->slabs_partial;
+		}
+
+		struct slab *slab
+			= list_first_entry(slab_list, struct slab, list);
+		assert(slab->freelist != NULL);
+		while (slab->freelist && ac->avail < ac->batchcount)
+			ac->entry[ac->avail++] = slab_get_obj(cache, slab);
+	}
+	return ac->avail;
+}
+
+/* Give the batchcount oldest objects of a full magazine back to their
+ * slabs; the most recently freed (cache-hot) ones stay.
+ */
+static void cache_flusharray(struct kmem_cache *cache, struct array_cache *ac)
+{
+	u32 n = MIN(ac->batchcount, ac->avail);
+
+	for (u32 i = 0; i < n; i++)
+		slab_put_obj(cache, ac->entry[i]);
+	ac->avail -= n;
+	memmove(ac->entry, ac->entry + n, ac->avail * sizeof(void *));
+}
+
+/* Size the magazines: fewer entries for larger objects, so idle
+ * magazines do not pin much memory.
+ */
+static void cache_init_magazines(struct kmem_cache *cache)
+{
+	u32 limit = cache->object_size > 1024  ? 8
+		    : cache->object_size > 256 ? 16
+					       : SLAB_MAG_MAX;
+
+	for (u32 cpu = 0; cpu < NR_CPUS; cpu++) {
+		struct array_cache *ac = &cache->cpu_cache[cpu];
+		ac->avail = 0;
+		ac->limit = limit;
+		ac->batchcount = (limit + 1) / 2;
+	}
+}
+
+void kmem_cache_drain(struct kmem_cache *cache)
+{
+	if (!cache)
+		return;
+
+	for (u32 cpu = 0; cpu < NR_CPUS; cpu++) {
+		struct array_cache *ac = &cache->cpu_cache[cpu];
+		for (u32 i = 0; i < ac->avail; i++)
+			slab_put_obj(cache, ac->entry[i]);
+		ac->avail = 0;
+	}
+}
+
+/* Memory pressure: empty slabs of all caches go back to the PMM */
+static u32 slab_shrink_count(struct shrinker *shrinker)
+{
+	u32 pages = 0;
+	struct kmem_cache *cache;
+	list_for_each_entry(cache, &kmem_caches, list)
+	{
+		struct slab *slab;
+		list_for_each_entry(slab, &cache->slabs_free, list)
+		{
+			pages += 1u << cache->order;
+		}
+	}
+	return pages;
+}
+
+static u32 slab_shrink_scan(struct shrinker *shrinker, u32 nr_pages)
+{
+	u32 freed = 0;
+	struct kmem_cache *cache;
+	list_for_each_entry(cache, &kmem_caches, list)
+	{
+		if (freed >= nr_pages)
+			break;
+		freed += kmem_cache_shrink(cache);
+	}
+	return freed;
+}
+
+static struct shrinker slab_shrinker = {
+	.name = "slab",
+	.count = slab_shrink_count,
+	.scan = slab_shrink_scan,
+};
+
+/* Initialize the slab subsystem. The heap must be up: cache descriptors
+ * are kmalloc'ed, and while the ladder is built kmalloc still falls back
+ * to the heap for them.
+ */
 int slab_init(void)
 {
 	INIT_LIST_HEAD(&kmem_caches);
-	log(LOG_OKAY, "SLAB: initialized");
+
+	u32 line = cpuid_cache_line_size();
+	if (line >= SLAB_MIN_ALIGN && (line & (line - 1)) == 0)
+		slab_line_size = line;
+
+	for (u32 i = 0; i < KMALLOC_NR_CACHES; i++) {
+		u32 size = 1u << (i + KMALLOC_MIN_SHIFT);
+		struct kmem_cache *cache = kmem_cache_create(
+			kmalloc_names[i], size, size, SLAB_FLAGS_NONE, NULL);
+		if (!cache)
+			return -1;
+		kmalloc_caches[i] = cache;
+	}
+
+	register_shrinker(&slab_shrinker);
+	log(LOG_OKAY, "SLAB: initialized, colouring in %u byte lines",
+	    slab_line_size);
 	return 0;
 }
 
+struct kmem_cache *kmalloc_slab(size_t size)
+{
+	if (size == 0 || size > KMALLOC_MAX_CACHE_SIZE)
+		return NULL;
+
+	u32 shift = size <= (1u << KMALLOC_MIN_SHIFT)
+			    ? KMALLOC_MIN_SHIFT
+			    : 32 - __builtin_clz((u32)size - 1);
+	return kmalloc_caches[shift - KMALLOC_MIN_SHIFT];
+}
+
+bool slab_owns(const void *ptr)
+{
+	return obj_to_slab(ptr) != NULL;
+}
+
+struct kmem_cache *slab_obj_cache(const void *obj)
+{
+	/* slabs that were given back are unmapped */
+	struct slab *slab = obj_to_slab(obj);
+	return slab ? slab->cache : NULL;
+}
+
 /* Create a kmem cache. Returns NULL on failure. */
 struct kmem_cache *kmem_cache_create(const char *name, uint32_t size,
                                      uint32_t align, uint32_t flags,
@@ -122,18 +451,21 @@ struct kmem_cache *kmem_cache_create(const char *name, uint32_t size,
 
     cache->align = align;
     cache->object_size = ALIGN_UP(size, align);
+    /* the freelist link must not clobber a constructed object, so such
+     * caches keep it behind the object
+     */
+    cache->free_offset = ctor ? cache->object_size : 0;
+    cache->slot_size = ctor ? ALIGN_UP(cache->object_size + sizeof(void *),
+                                       align)
+                            : cache->object_size;
     cache->flags = flags;
     cache->ctor = ctor;
 
-    /* Compute objects_per_slab using dummy address */
-    uintptr_t dummy_virt = 0;
-    uintptr_t first_obj_off = ALIGN_UP(dummy_virt + sizeof(struct slab), align);
-    uint32_t avail = PAGE_SIZE - first_obj_off;
-    cache->objects_per_slab = avail / cache->object_size;
-
-    if (cache->objects_per_slab == 0) {
+    /* Large objects keep struct slab out of the slab */
+    cache->off_slab = cache->object_size >= SLAB_OFF_SLAB_MIN;
+    if (slab_calculate_order(cache) == 0) {
         kfree(cache);
-        log(LOG_WARN, "SLAB: object too large for page (cache=%s)", name);
+        log(LOG_WARN, "SLAB: object too large for a slab (cache=%s)", name);
         return NULL;
     }
 
@@ -141,12 +473,16 @@ struct kmem_cache *kmem_cache_create(const char *name, uint32_t size,
     INIT_LIST_HEAD(&cache->slabs_partial);
     INIT_LIST_HEAD(&cache->slabs_free);
     INIT_LIST_HEAD(&cache->list);
+    cache_init_magazines(cache);
 
     /* Add cache to global list */
     list_add_tail(&cache->list, &kmem_caches);
 
-    log(LOG_OKAY, "SLAB: created cache '%s' obj_size=%u objs_per_slab=%u",
-        cache->name, cache->object_size, cache->objects_per_slab);
+    log(LOG_OKAY,
+        "SLAB: created cache '%s' obj_size=%u objs_per_slab=%u order=%u "
+        "colours=%u%s",
+        cache->name, cache->object_size, cache->objects_per_slab,
+        cache->order, cache->colour, cache->off_slab ? " off-slab" : "");
 
     return cache;
 }
@@ -157,6 +493,8 @@ void kmem_cache_destroy(struct kmem_cache *cache)
 	if (!cache)
 		return;
 
+	kmem_cache_drain(cache);
+
 	/* Warn if there are in-use objects in full/partial lists */
 	bool inuse = !list_empty(&cache->slabs_full)
 		     || !list_empty(&cache->slabs_partial);
@@ -179,85 +517,109 @@ void kmem_cache_destroy(struct kmem_cache *cache)
 			struct slab *slab
 				= list_first_entry(head, struct slab, list);
 			list_del(&slab->list);
-
-			uintptr_t virt = (uintptr_t)slab;
-			uint32_t phys = vmm_get_physical_addr((u32)virt) & ~0xFFF;
-			vmm_unmap_page((u32)virt);
-			pmm_free_page(phys);
+			free_slab(cache, slab);
 		}
 	}
 
-	/* Free the cache metadata page itself */
-	{
-		uintptr_t virt_cache = (uintptr_t)cache;
-		uint32_t phys_cache = vmm_get_physical_addr((u32)virt_cache);
-		vmm_unmap_page((u32)virt_cache);
-		pmm_free_page(phys_cache);
-	}
+	/* The descriptor (and its name) came from kmalloc */
+	kfree(cache);
 }
 
 /* Try to reclaim/free slabs on the slabs_free list back to PMM.
- * Best-effort: frees fully-empty slabs. Leaves partial/full ones alone.
+ * Best-effort: drains the magazines, then frees fully-empty slabs. Leaves
+ * partial/full ones alone. Returns the number of pages freed.
  */
-void kmem_cache_shrink(struct kmem_cache *cache)
+u32 kmem_cache_shrink(struct kmem_cache *cache)
 {
 	if (!cache)
-		return;
+		return 0;
+
+	kmem_cache_drain(cache);
 
 	struct list_head *head = &cache->slabs_free;
+	u32 pages = 0;
 
 	/* Iterate while there are free slabs; remove and free them */
 	while (!list_empty(head)) {
 		struct slab *slab = list_first_entry(head, struct slab, list);
 		list_del(&slab->list);
-
-		uintptr_t virt = (uintptr_t)slab;
-		/* get physical page for this slab and unmap then free it */
-		uint32_t phys = vmm_get_physical_addr((u32)virt) & ~0xFFF;
-		vmm_unmap_page((u32)virt);
-		pmm_free_page(phys);
-		/* continue to next slab */
+		free_slab(cache, slab);
+		pages += 1u << cache->order;
 	}
+	return pages;
 }
 
-/* Allocate one object from the cache. Returns NULL on failure. */
-void *kmem_cache_alloc(struct kmem_cache *cache)
+/* Take one object from the CPU's magazine, refilling it if empty */
+static void *slab_alloc(struct kmem_cache *cache, bool zero)
 {
 	if (!cache)
 		return NULL;
 
-	/* Prefer partial slabs, fall back to free list */
-	struct list_head *slab_list = !list_empty(&cache->slabs_partial)
-					      ? &cache->slabs_partial
-					      : &cache->slabs_free;
-
-	if (list_empty(slab_list)) {
-		/* Need a new slab */
-		if (new_slab(cache) != 0)
+	struct array_cache *ac = cpu_cache(cache);
+	if (ac->avail) {
+		ac->allochit++;
+	} else {
+		ac->allocmiss++;
+		if (cache_refill(cache, ac) == 0)
 			return NULL;
-		slab_list = &cache->slabs_partial;
 	}
+	void *obj = ac->entry[--ac->avail];
+	slab_init_obj(cache, obj, zero);
+	return obj;
+}
 
-	struct slab *slab = list_first_entry(slab_list, struct slab, list);
-	/* Pop an object from the freelist */
-	void *obj = slab->freelist;
-	assert(obj != NULL);
-	slab->freelist = get_next_free(obj);
-	slab->inuse++;
+/* Allocate one object from the cache. Returns NULL on failure. */
+void *kmem_cache_alloc(struct kmem_cache *cache)
+{
+	return slab_alloc(cache, cache && (cache->flags & SLAB_FLAGS_ZERO));
+}
 
-	/* Zero the object area before returning it */
-	memset(obj, 0, cache->object_size);
+void *kmem_cache_zalloc(struct kmem_cache *cache)
+{
+	return slab_alloc(cache, true);
+}
 
-	/* Call constructor if present (constructor may use the object) */
-	if (cache->ctor)
-		cache->ctor(obj);
+u32 kmem_cache_alloc_bulk(struct kmem_cache *cache, u32 n, void **objs)
+{
+	if (!cache || !objs)
+		return 0;
+
+	/* cache-hot objects from the magazine first */
+	struct array_cache *ac = cpu_cache(cache);
+	u32 got = 0;
+	while (got < n && ac->avail)
+		objs[got++] = ac->entry[--ac->avail];
+
+	while (got < n) {
+		struct list_head *slab_list = !list_empty(&cache->slabs_partial)
+						      ? &cache->slabs_partial
+						      : &cache->slabs_free;
+		if (list_empty(slab_list)) {
+			if (new_slab(cache) != 0) {
+				kmem_cache_free_bulk(cache, got, objs);
+				return 0;
+			}
+			slab_list = &cache->slabs_partial;
+		}
 
-	/* If slab became full, move it to full list */
-	if (slab->inuse == cache->objects_per_slab) {
-		list_move_tail(&slab->list, &cache->slabs_full);
+		/* take as much of this slab's freelist as needed */
+		struct slab *slab
+			= list_first_entry(slab_list, struct slab, list);
+		u32 take = MIN(n - got, cache->objects_per_slab - slab->inuse);
+		void *obj = slab->freelist;
+		for (u32 i = 0; i < take; i++) {
+			objs[got++] = obj;
+			obj = get_next_free(cache, obj);
+		}
+		slab->freelist = obj;
+		slab->inuse += take;
+		slab_requeue(cache, slab);
 	}
 
-	return obj;
+	bool zero = cache->flags & SLAB_FLAGS_ZERO;
+	for (u32 i = 0; i < n; i++)
+		slab_init_obj(cache, objs[i], zero);
+	return n;
 }
 
 /* Free an object back to its cache. */
@@ -269,7 +631,7 @@ void kmem_cache_free(struct kmem_cache *cache, void *obj)
 	struct slab *slab = obj_to_slab(obj);
 
 	/* Basic sanity check: ensure the object belongs to the cache. */
-	if (slab->cache != cache) {
+	if (!slab || slab->cache != cache) {
 		log(LOG_WARN,
 		    "SLAB: object %p does not belong to cache '%s' (possible "
 		    "leak or "
@@ -278,21 +640,52 @@ void kmem_cache_free(struct kmem_cache *cache, void *obj)
 		return;
 	}
 
-	/* Push object back onto freelist */
-	set_next_free(obj, slab->freelist);
-	slab->freelist = obj;
-	if (slab->inuse == 0) {
-		/* shouldn't happen, but guard against underflow */
-		log(LOG_WARN, "SLAB: double free detected for cache '%s'",
-		    cache->name);
-		return;
+	struct array_cache *ac = cpu_cache(cache);
+	if (ac->avail < ac->limit) {
+		ac->freehit++;
+	} else {
+		ac->freemiss++;
+		cache_flusharray(cache, ac);
 	}
-	slab->inuse--;
+	ac->entry[ac->avail++] = obj;
+}
 
-	/* Move slab between lists depending on occupancy */
-	list_del_init(&slab->list);
-	if (slab->inuse == 0)
-		list_add_tail(&slab->list, &cache->slabs_free);
-	else
-		list_add_tail(&slab->list, &cache->slabs_partial);
+void kmem_cache_free_bulk(struct kmem_cache *cache, u32 n, void **objs)
+{
+	if (!cache || !objs)
+		return;
+
+	/* objects from the same slab usually come in runs; requeue the slab
+	 * once per run instead of once per object
+	 */
+	struct slab *run = NULL;
+	for (u32 i = 0; i < n; i++) {
+		if (!objs[i])
+			continue;
+
+		struct slab *slab = obj_to_slab(objs[i]);
+		if (slab != run) {
+			if (run)
+				slab_requeue(cache, run);
+			run = NULL;
+		}
+		if (!slab || slab->cache != cache) {
+			log(LOG_WARN,
+			    "SLAB: object %p does not belong to cache '%s'",
+			    objs[i], cache->name);
+			continue;
+		}
+		if (slab->inuse == 0) {
+			log(LOG_WARN, "SLAB: double free detected for cache '%s'",
+			    cache->name);
+			continue;
+		}
+
+		set_next_free(cache, objs[i], slab->freelist);
+		slab->freelist = objs[i];
+		slab->inuse--;
+		run = slab;
+	}
+	if (run)
+		slab_requeue(cache, run);
 }
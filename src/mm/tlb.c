@@ -0,0 +1,94 @@
+#include <kernel/kernel.h>
+#include <mm/page.h>
+#include <mm/tlb.h>
+#include <mm/vmm.h>
+
+/* Past this many invlpg a CR3 reload and refill is cheaper */
+u32 tlb_flush_threshold = 32;
+
+static tlb_stats_t tlb_stats;
+
+void tlb_gather_mmu(struct mmu_gather *tlb, bool free_frames)
+{
+	tlb->start = 0xFFFFFFFFu;
+	tlb->end = 0;
+	tlb->need_flush_all = false;
+	tlb->free_frames = free_frames;
+	tlb->nr_pages = 0;
+}
+
+void tlb_add_range(struct mmu_gather *tlb, u32 virt, u32 size, bool global)
+{
+	tlb->start = MIN(tlb->start, virt);
+	if (virt + size > tlb->end)
+		tlb->end = virt + size;
+	if (global)
+		tlb->need_flush_all = true;
+}
+
+/* Queue a page to be put after the next flush */
+static void tlb_queue_page(struct mmu_gather *tlb, struct page *page)
+{
+	if (tlb->nr_pages == MMU_GATHER_BATCH)
+		tlb_flush_mmu(tlb);
+	tlb->pages[tlb->nr_pages++] = page;
+}
+
+void tlb_remove_pte(struct mmu_gather *tlb, u32 virt, u32 pte)
+{
+	tlb_add_range(tlb, virt, PAGE_SIZE, (pte & PAGE_FLAG_GLOBAL) != 0);
+
+	if (!tlb->free_frames)
+		return;
+	struct page *page = phys_to_page(pte & ~0xFFF);
+	if (page && !(page->flags & PG_RESERVED))
+		tlb_queue_page(tlb, page);
+}
+
+void tlb_remove_table(struct mmu_gather *tlb, u32 pt_phys)
+{
+	struct page *page = phys_to_page(pt_phys);
+	if (page)
+		tlb_queue_page(tlb, page);
+}
+
+void tlb_flush_mmu(struct mmu_gather *tlb)
+{
+	if (tlb->end > tlb->start) {
+		u32 pages = (tlb->end - tlb->start) >> PAGE_SHIFT;
+		if (pages > tlb_flush_threshold) {
+			/* a global entry survives a plain CR3 reload */
+			if (tlb->need_flush_all)
+				vmm_flush_tlb_all();
+			else
+				vmm_flush_tlb();
+			tlb_stats.full_flushes++;
+		} else {
+			for (u32 va = tlb->start; va < tlb->end; va += PAGE_SIZE)
+				__asm__ volatile("invlpg (%0)" ::"r"(va)
+						 : "memory");
+			tlb_stats.invlpg_flushes++;
+		}
+	}
+
+	/* nothing can reach the frames through the TLB any more */
+	for (u32 i = 0; i < tlb->nr_pages; i++)
+		put_page(tlb->pages[i]);
+	tlb_stats.frames_freed += tlb->nr_pages;
+
+	tlb->nr_pages = 0;
+	tlb->start = 0xFFFFFFFFu;
+	tlb->end = 0;
+	tlb->need_flush_all = false;
+}
+
+void tlb_finish_mmu(struct mmu_gather *tlb)
+{
+	tlb_flush_mmu(tlb);
+}
+
+void tlb_get_stats(tlb_stats_t *stats)
+{
+	if (stats)
+		*stats = tlb_stats;
+}
@@ -1,7 +1,10 @@
 #include <misc/logger.h>
 #include <mm/bitmap.h>
 #include <mm/heap.h>
+#include <mm/page.h>
 #include <mm/slab.h>
+#include <mm/tlb.h>
+#include <mm/vmalloc.h>
 #include <mm/vma.h>
 #include <mm/vmm.h>
 #include <printf.h>
@@ -9,57 +12,208 @@
 
 #define VMA_MAGIC 0xBEEFBEEF
 
-/* unmapped_area: find a free virtual region of 'len' bytes.
- * Strategy: scan VMAs in mm->mmap for gaps starting from a sane base.
- * Returns 0 on failure or the aligned start virtual address on success.
+/* Automatic placement searches [VMA_SEARCH_START, VMA_SEARCH_END); the
+ * kernel heap and vmalloc arena start right above it.
+ */
+#define VMA_SEARCH_START 0x20000000UL
+#define VMA_SEARCH_END ((unsigned long)VMALLOC_START)
+
+#define VMACACHE_HASH(addr) (((addr) >> PAGE_SHIFT) & VMACACHE_MASK)
+
+void vmacache_flush(mm_struct *mm)
+{
+	for (u32 i = 0; i < VMACACHE_SIZE; i++)
+		mm->vmacache[i] = NULL;
+}
+
+/* A cached VMA that contains addr, or NULL */
+static vm_area_struct *vmacache_find(mm_struct *mm, unsigned long addr)
+{
+	for (u32 i = 0; i < VMACACHE_SIZE; i++) {
+		vm_area_struct *vma = mm->vmacache[i];
+		if (vma && vma->vm_start <= addr && vma->vm_end > addr)
+			return vma;
+	}
+	return NULL;
+}
+
+/* Free space between the previous VMA and this one */
+static inline unsigned long vma_compute_gap(vm_area_struct *vma)
+{
+	return vma->vm_start - (vma->vm_prev ? vma->vm_prev->vm_end : 0);
+}
+
+RB_DECLARE_CALLBACKS_MAX(static, vma_gap_callbacks, struct vm_area_struct,
+			 vm_rb, unsigned long, rb_subtree_gap, vma_compute_gap)
+
+/* Refresh the cached gaps after vma's gap changed */
+static inline void vma_gap_update(vm_area_struct *vma)
+{
+	vma_gap_callbacks.propagate(&vma->vm_rb, NULL);
+}
+
+/* Find where a VMA covering [start, end) goes. Returns -1 if it would
+ * overlap an existing VMA, else fills in the tree link and the VMA that
+ * will precede it.
+ */
+static int find_vma_links(mm_struct *mm, unsigned long start,
+			  unsigned long end, vm_area_struct **pprev,
+			  struct rb_node ***rb_link, struct rb_node **rb_parent)
+{
+	struct rb_node **link = &mm->mm_rb.rb_node;
+	struct rb_node *parent = NULL, *prev = NULL;
+
+	while (*link) {
+		parent = *link;
+		vm_area_struct *tmp = rb_entry(parent, vm_area_struct, vm_rb);
+		if (tmp->vm_end > start) {
+			if (tmp->vm_start < end)
+				return -1;
+			link = &parent->rb_left;
+		} else {
+			prev = parent;
+			link = &parent->rb_right;
+		}
+	}
+
+	*pprev = prev ? rb_entry(prev, vm_area_struct, vm_rb) : NULL;
+	*rb_link = link;
+	*rb_parent = parent;
+	return 0;
+}
+
+/* Link vma into the list after prev and into the tree at rb_link */
+static void vma_link(mm_struct *mm, vm_area_struct *vma, vm_area_struct *prev,
+		     struct rb_node **rb_link, struct rb_node *rb_parent)
+{
+	vm_area_struct *next = prev ? prev->vm_next : mm->mmap;
+
+	vmacache_flush(mm);
+	vma->vm_prev = prev;
+	vma->vm_next = next;
+	if (prev)
+		prev->vm_next = vma;
+	else
+		mm->mmap = vma;
+
+	/* next's gap shrinks to the space after vma */
+	if (next) {
+		next->vm_prev = vma;
+		vma_gap_update(next);
+	} else {
+		mm->highest_vm_end = vma->vm_end;
+	}
+
+	rb_link_node(&vma->vm_rb, rb_parent, rb_link);
+	vma->rb_subtree_gap = 0;
+	vma_gap_update(vma);
+	rb_insert_augmented(&vma->vm_rb, &mm->mm_rb, &vma_gap_callbacks);
+	mm->map_count++;
+}
+
+/* Take vma out of the list and the tree */
+static void vma_unlink(mm_struct *mm, vm_area_struct *vma)
+{
+	vm_area_struct *prev = vma->vm_prev, *next = vma->vm_next;
+
+	vmacache_flush(mm);
+	rb_erase_augmented(&vma->vm_rb, &mm->mm_rb, &vma_gap_callbacks);
+	if (prev)
+		prev->vm_next = next;
+	else
+		mm->mmap = next;
+
+	/* next's gap now reaches back to prev */
+	if (next) {
+		next->vm_prev = prev;
+		vma_gap_update(next);
+	} else {
+		mm->highest_vm_end = prev ? prev->vm_end : 0;
+	}
+
+	vma->vm_next = vma->vm_prev = NULL;
+	mm->map_count--;
+}
+
+/* unmapped_area: find the lowest free region of 'len' bytes in the search
+ * window. Subtrees whose largest gap is too small are skipped, so the
+ * search is O(log n). Returns 0 on failure or the start address.
  */
 static unsigned long unmapped_area(mm_struct *mm, unsigned long len)
 {
 	if (!mm || len == 0)
 		return 0;
 
-	/* Search from a conservative userland base upwards.
-	 * Keep within a large canonical user range for this simple kernel.
-	 */
-	const unsigned long SEARCH_START = 0x20000000UL; /* 512MB */
-	const unsigned long SEARCH_END = 0xF0000000UL;   /* avoid kernel/top area */
-
-	unsigned long need = ALIGN_UP(len, PAGE_SIZE);
-	vm_area_struct *v = mm->mmap;
-	unsigned long addr = SEARCH_START;
-
-	/* If no mappings exist, return SEARCH_START if it fits */
-	if (!v) {
-		if (addr + need < SEARCH_END)
-			return addr;
+	unsigned long length = ALIGN_UP(len, PAGE_SIZE);
+	if (length < len || length > VMA_SEARCH_END - VMA_SEARCH_START)
 		return 0;
-	}
 
-	/* Walk the VMAs and find a gap large enough */
-	while (v) {
-		/* If the VMA starts after our candidate and the gap fits -> use it */
-		if (v->vm_start > addr) {
-			unsigned long gap_end = v->vm_start;
-			if (gap_end >= addr && gap_end - addr >= need) {
-				return addr;
+	/* a gap fits if it ends at or above low_limit and starts at or
+	 * below high_limit
+	 */
+	unsigned long low_limit = VMA_SEARCH_START + length;
+	unsigned long high_limit = VMA_SEARCH_END - length;
+	unsigned long gap_start, gap_end;
+	vm_area_struct *vma;
+
+	if (RB_EMPTY_ROOT(&mm->mm_rb))
+		goto check_highest;
+	vma = rb_entry(mm->mm_rb.rb_node, vm_area_struct, vm_rb);
+	if (vma->rb_subtree_gap < length)
+		goto check_highest;
+
+	while (true) {
+		/* the lowest fit is in the left subtree if it has one */
+		gap_end = vma->vm_start;
+		if (gap_end >= low_limit && vma->vm_rb.rb_left) {
+			vm_area_struct *left = rb_entry(vma->vm_rb.rb_left,
+							vm_area_struct, vm_rb);
+			if (left->rb_subtree_gap >= length) {
+				vma = left;
+				continue;
 			}
 		}
-		/* Move candidate to just after this VMA */
-		if (v->vm_end > addr)
-			addr = ALIGN_UP(v->vm_end, PAGE_SIZE);
 
-		/* If candidate exceeds search end, fail */
-		if (addr + need >= SEARCH_END)
+		gap_start = vma->vm_prev ? vma->vm_prev->vm_end : 0;
+check_current:
+		if (gap_start > high_limit)
 			return 0;
+		if (gap_end >= low_limit && gap_end > gap_start
+		    && gap_end - gap_start >= length)
+			goto found;
+
+		if (vma->vm_rb.rb_right) {
+			vm_area_struct *right = rb_entry(vma->vm_rb.rb_right,
+							 vm_area_struct, vm_rb);
+			if (right->rb_subtree_gap >= length) {
+				vma = right;
+				continue;
+			}
+		}
 
-		v = v->vm_next;
+		/* climb to the first ancestor we reached from its left,
+		 * its own gap is the next candidate in address order
+		 */
+		while (true) {
+			struct rb_node *prev = &vma->vm_rb;
+			if (!rb_parent(prev))
+				goto check_highest;
+			vma = rb_entry(rb_parent(prev), vm_area_struct, vm_rb);
+			if (prev == vma->vm_rb.rb_left) {
+				gap_start = vma->vm_prev->vm_end;
+				gap_end = vma->vm_start;
+				goto check_current;
+			}
+		}
 	}
 
-	/* No intervening VMA; end of list available */
-	if (addr + need < SEARCH_END)
-		return addr;
-
-	return 0;
+check_highest:
+	/* the space above the last VMA */
+	gap_start = mm->highest_vm_end;
+	if (gap_start > high_limit)
+		return 0;
+found:
+	return MAX(gap_start, VMA_SEARCH_START);
 }
 
 /* mm management */
@@ -69,7 +223,12 @@ mm_struct *mm_create(void)
 	if (!mm)
 		return NULL;
 	mm->mmap = NULL;
+	mm->mm_rb = RB_ROOT;
+	mm->highest_vm_end = 0;
 	mm->map_count = 0;
+	vmacache_flush(mm);
+	mm->vmacache_hits = 0;
+	mm->vmacache_misses = 0;
 	return mm;
 }
 
@@ -78,17 +237,18 @@ void mm_destroy(mm_struct *mm)
 	if (!mm)
 		return;
 
-	/* remove and free all VMAs */
+	/* remove and free all VMAs, returning their frames in batches */
+	struct mmu_gather tlb;
+	tlb_gather_mmu(&tlb, true);
 	vm_area_struct *v = mm->mmap;
 	while (v) {
 		vm_area_struct *next = v->vm_next;
-		/* best-effort unmap pages */
-		unsigned long pages = vma_pages(v);
-		for (unsigned long i = 0; i < pages; ++i)
-			vmm_unmap_page(v->vm_start + i * PAGE_SIZE);
+		vmm_unmap_range_gather(&tlb, v->vm_start,
+				       v->vm_end - v->vm_start);
 		vm_area_free(v);
 		v = next;
 	}
+	tlb_finish_mmu(&tlb);
 	kfree(mm);
 }
 
@@ -115,38 +275,45 @@ struct vm_area_struct *find_vma(mm_struct *mm, unsigned long addr)
 {
 	if (!mm)
 		return NULL;
-	vm_area_struct *v = mm->mmap;
-	while (v) {
-		if (v->vm_end > addr)
-			return v;
-		v = v->vm_next;
+
+	vm_area_struct *vma = vmacache_find(mm, addr);
+	if (vma) {
+		mm->vmacache_hits++;
+		return vma;
 	}
-	return NULL;
+	mm->vmacache_misses++;
+
+	struct rb_node *node = mm->mm_rb.rb_node;
+	while (node) {
+		vm_area_struct *tmp = rb_entry(node, vm_area_struct, vm_rb);
+		if (tmp->vm_end > addr) {
+			vma = tmp;
+			if (tmp->vm_start <= addr)
+				break;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+	if (vma)
+		mm->vmacache[VMACACHE_HASH(addr)] = vma;
+	return vma;
 }
 
 /* find previous vma before addr; if prevp provided store prev */
 struct vm_area_struct *find_vma_prev(mm_struct *mm, unsigned long addr,
 				     struct vm_area_struct **prevp)
 {
-	if (!mm) {
-		if (prevp)
-			*prevp = NULL;
-		return NULL;
-	}
-	vm_area_struct *prev = NULL;
-	vm_area_struct *v = mm->mmap;
-	while (v) {
-		if (v->vm_end > addr) {
-			if (prevp)
-				*prevp = prev;
-			return v;
-		}
-		prev = v;
-		v = v->vm_next;
+	vm_area_struct *vma = find_vma(mm, addr);
+	if (prevp) {
+		if (vma)
+			*prevp = vma->vm_prev;
+		else
+			*prevp = mm ? rb_entry_safe(rb_last(&mm->mm_rb),
+						    vm_area_struct, vm_rb)
+				    : NULL;
 	}
-	if (prevp)
-		*prevp = prev;
-	return NULL;
+	return vma;
 }
 
 /* insert vma in sorted list; fail (-1) if overlaps */
@@ -157,36 +324,12 @@ int insert_vm_struct(mm_struct *mm, struct vm_area_struct *vma)
 	if (vma->vm_start >= vma->vm_end)
 		return -1;
 
-	/* empty list */
-	if (!mm->mmap) {
-		mm->mmap = vma;
-		vma->vm_next = NULL;
-		mm->map_count++;
-		return 0;
-	}
-
-	vm_area_struct *cur = mm->mmap;
-	vm_area_struct *prev = NULL;
-	while (cur && cur->vm_start < vma->vm_start) {
-		prev = cur;
-		cur = cur->vm_next;
-	}
-
-	if (prev && prev->vm_end > vma->vm_start)
-		return -1;
-	if (cur && vma->vm_end > cur->vm_start)
+	vm_area_struct *prev;
+	struct rb_node **rb_link, *rb_parent;
+	if (find_vma_links(mm, vma->vm_start, vma->vm_end, &prev, &rb_link,
+			   &rb_parent))
 		return -1;
-
-	if (!prev) {
-		vma->vm_next = mm->mmap;
-		mm->mmap = vma;
-		if (vma->vm_end > mm->mmap->vm_start)
-			return -1; /* overlap with new head */
-	} else {
-		vma->vm_next = prev->vm_next;
-		prev->vm_next = vma;
-	}
-	mm->map_count++;
+	vma_link(mm, vma, prev, rb_link, rb_parent);
 	return 0;
 }
 
@@ -195,21 +338,7 @@ void remove_vm_struct(mm_struct *mm, struct vm_area_struct *vma)
 {
 	if (!mm || !vma)
 		return;
-	vm_area_struct *prev = NULL;
-	vm_area_struct *cur = mm->mmap;
-	while (cur) {
-		if (cur == vma) {
-			if (!prev)
-				mm->mmap = cur->vm_next;
-			else
-				prev->vm_next = cur->vm_next;
-			mm->map_count--;
-			cur->vm_next = NULL;
-			return;
-		}
-		prev = cur;
-		cur = cur->vm_next;
-	}
+	vma_unlink(mm, vma);
 }
 
 /* split vma at addr; returns newly created upper vma pointer or NULL on error
@@ -233,19 +362,93 @@ struct vm_area_struct *split_vma_at(mm_struct *mm, struct vm_area_struct *vma,
 
 	vma->vm_end = addr;
 
-	/* insert upper after vma */
-	upper->vm_next = vma->vm_next;
-	vma->vm_next = upper;
-	mm->map_count++;
+	/* upper goes right after vma, in the list and in the tree */
+	struct rb_node **rb_link = &vma->vm_rb.rb_right;
+	struct rb_node *rb_parent = &vma->vm_rb;
+	while (*rb_link) {
+		rb_parent = *rb_link;
+		rb_link = &rb_parent->rb_left;
+	}
+	vma_link(mm, upper, vma, rb_link, rb_parent);
 	return upper;
 }
 
+/* Move the end of vma, keeping the next VMA's gap up to date */
+static void vma_set_end(mm_struct *mm, vm_area_struct *vma, unsigned long end)
+{
+	vmacache_flush(mm);
+	vma->vm_end = end;
+	if (vma->vm_next)
+		vma_gap_update(vma->vm_next);
+	else
+		mm->highest_vm_end = end;
+}
+
+/* Move the start of vma down to start */
+static void vma_set_start(mm_struct *mm, vm_area_struct *vma,
+			  unsigned long start)
+{
+	vmacache_flush(mm);
+	vma->vm_pgoff -= PHYS_PFN(vma->vm_start - start);
+	vma->vm_start = start;
+	vma_gap_update(vma);
+}
+
+/*
+ * Try to cover [start, end) by growing the neighbours prev and prev's
+ * successor instead of adding a VMA. A neighbour qualifies when it abuts
+ * the range, has the same flags and its page offset continues across the
+ * boundary. Filling a hole between two such VMAs joins them into one.
+ * Returns the VMA now covering the range, or NULL.
+ */
+static vm_area_struct *vma_merge(mm_struct *mm, vm_area_struct *prev,
+				 unsigned long start, unsigned long end,
+				 u32 vm_flags)
+{
+	vm_area_struct *next = prev ? prev->vm_next : mm->mmap;
+	bool merge_prev = prev && prev->vm_end == start
+			  && prev->vm_flags == vm_flags
+			  && prev->vm_pgoff + vma_pages(prev) == PHYS_PFN(start);
+	bool merge_next = next && next->vm_start == end
+			  && next->vm_flags == vm_flags
+			  && next->vm_pgoff == PHYS_PFN(end);
+
+	if (merge_prev && merge_next) {
+		unsigned long next_end = next->vm_end;
+		vma_unlink(mm, next);
+		vm_area_free(next);
+		vma_set_end(mm, prev, next_end);
+		return prev;
+	}
+	if (merge_prev) {
+		vma_set_end(mm, prev, end);
+		return prev;
+	}
+	if (merge_next) {
+		vma_set_start(mm, next, start);
+		return next;
+	}
+	return NULL;
+}
+
+/* Unmap and free the first pages pages of a failed immediate mapping */
+static void mmap_rollback(unsigned long start, unsigned long pages)
+{
+	if (pages == 0)
+		return;
+
+	struct mmu_gather tlb;
+	tlb_gather_mmu(&tlb, true);
+	vmm_unmap_range_gather(&tlb, start, pages * PAGE_SIZE);
+	tlb_finish_mmu(&tlb);
+}
+
 /*
  * mmap_anonymous: simple anonymous mapping
  * - Align addr and len to page boundaries.
  * - If addr == 0 -> find a free region via unmapped_area()
- * - Insert VMA
  * - If flags include VM_MAP_IMMEDIATE -> allocate pages and map them
+ * - Merge into an adjacent compatible VMA, or insert a new one
  */
 kernel_status_t mmap_anonymous(mm_struct *mm, unsigned long addr, size_t len,
 			       u32 flags, unsigned long *out_addr)
@@ -279,48 +482,50 @@ kernel_status_t mmap_anonymous(mm_struct *mm, unsigned long addr, size_t len,
 	if (end <= start)
 		return KERNEL_INVALID_PARAM;
 
-	vm_area_struct *vma = vm_area_alloc();
-	if (!vma)
-		return KERNEL_OUT_OF_MEMORY;
-
-	vma->vm_start = start;
-	vma->vm_end = end;
-	vma->vm_pgoff = start >> PAGE_SHIFT;
-	vma->vm_flags = VM_ANON
-			| (flags & (VM_READ | VM_WRITE | VM_EXEC | VM_SHARED));
-
-	if (insert_vm_struct(mm, vma) != 0) {
-		vm_area_free(vma);
+	u32 vm_flags = VM_ANON
+		       | (flags & (VM_READ | VM_WRITE | VM_EXEC | VM_SHARED));
+	vm_area_struct *prev;
+	struct rb_node **rb_link, *rb_parent;
+	if (find_vma_links(mm, start, end, &prev, &rb_link, &rb_parent))
 		return KERNEL_ALREADY_MAPPED;
-	}
 
-	/* Optionally map pages immediately */
+	/* Optionally map pages immediately. This happens before the VMA
+	 * exists, so a failure only has the pages to undo.
+	 */
+	unsigned long pages = 0;
 	if (flags & VM_MAP_IMMEDIATE) {
-		unsigned long pages = (end - start) >> PAGE_SHIFT;
-		for (unsigned long i = 0; i < pages; ++i) {
-			unsigned long va = start + i * PAGE_SIZE;
-			u32 phys = pmm_alloc_page();
+		for (; pages < (end - start) >> PAGE_SHIFT; ++pages) {
+			unsigned long va = start + pages * PAGE_SIZE;
+			u32 phys = pmm_alloc_zeroed_page(PMM_ZONE_HIGH);
 			if (!phys) {
-				/* rollback: unmap previous pages and remove vma */
-				for (unsigned long j = 0; j < i; ++j) {
-					vmm_unmap_page(start + j * PAGE_SIZE);
-				}
-				remove_vm_struct(mm, vma);
-				vm_area_free(vma);
+				mmap_rollback(start, pages);
 				return KERNEL_OUT_OF_MEMORY;
 			}
 			kernel_status_t st = vmm_map_page(
 				va, phys, PAGE_FLAG_PRESENT | PAGE_FLAG_RW);
 			if (st != KERNEL_OK) {
 				pmm_free_page(phys);
-				for (unsigned long j = 0; j < i; ++j) {
-					vmm_unmap_page(start + j * PAGE_SIZE);
-				}
-				remove_vm_struct(mm, vma);
-				vm_area_free(vma);
+				mmap_rollback(start, pages);
 				return st;
 			}
+			page_set_owner(phys, PG_ANON, mm);
+		}
+	}
+
+	/* extend a neighbour where possible, so back to back mappings do
+	 * not pile up VMAs
+	 */
+	if (!vma_merge(mm, prev, start, end, vm_flags)) {
+		vm_area_struct *vma = vm_area_alloc();
+		if (!vma) {
+			mmap_rollback(start, pages);
+			return KERNEL_OUT_OF_MEMORY;
 		}
+		vma->vm_start = start;
+		vma->vm_end = end;
+		vma->vm_pgoff = start >> PAGE_SHIFT;
+		vma->vm_flags = vm_flags;
+		vma_link(mm, vma, prev, rb_link, rb_parent);
 	}
 
 	if (out_addr)
@@ -342,54 +547,47 @@ kernel_status_t munmap_range(mm_struct *mm, unsigned long addr, size_t len)
 	unsigned long end = ALIGN_UP(addr + len, PAGE_SIZE);
 
 	vm_area_struct *v = find_vma(mm, start);
-	vm_area_struct *prev = NULL;
+	struct mmu_gather tlb;
 
 	/* If first vma starts before range and overlaps, split it */
 	if (v && v->vm_start < start && v->vm_end > start) {
 		vm_area_struct *upper = split_vma_at(mm, v, start);
 		if (!upper)
 			return KERNEL_OUT_OF_MEMORY;
-		prev = v;
 		v = upper;
 	}
 
+	tlb_gather_mmu(&tlb, true);
+
 	while (v && v->vm_start < end) {
 		/* If v extends past end, split tail and remove the lower part */
 		if (v->vm_end > end) {
 			vm_area_struct *upper = split_vma_at(mm, v, end);
-			if (!upper)
+			if (!upper) {
+				tlb_finish_mmu(&tlb);
 				return KERNEL_OUT_OF_MEMORY;
+			}
 			/* unmap pages of v (now lower) */
-			unsigned long pages = vma_pages(v);
-			for (unsigned long i = 0; i < pages; ++i)
-				vmm_unmap_page(v->vm_start + i * PAGE_SIZE);
-
-			/* remove v from list */
-			if (prev)
-				prev->vm_next = upper;
-			else
-				mm->mmap = upper;
-			mm->map_count--;
+			vmm_unmap_range_gather(&tlb, v->vm_start,
+					       v->vm_end - v->vm_start);
+
+			vma_unlink(mm, v);
 			vm_area_free(v);
-			return KERNEL_OK;
+			break;
 		}
 
 		/* v fully inside [start,end) */
 		vm_area_struct *next = v->vm_next;
-		unsigned long pages = vma_pages(v);
-		for (unsigned long i = 0; i < pages; ++i)
-			vmm_unmap_page(v->vm_start + i * PAGE_SIZE);
+		vmm_unmap_range_gather(&tlb, v->vm_start,
+				       v->vm_end - v->vm_start);
 
-		if (prev)
-			prev->vm_next = next;
-		else
-			mm->mmap = next;
-		mm->map_count--;
+		vma_unlink(mm, v);
 		vm_area_free(v);
 
 		v = next;
 	}
 
+	tlb_finish_mmu(&tlb);
 	return KERNEL_OK;
 }
 
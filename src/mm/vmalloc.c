@@ -0,0 +1,467 @@
+#include <kernel/kernel.h>
+#include <misc/logger.h>
+#include <misc/rbtree.h>
+#include <mm/bitmap.h>
+#include <mm/page.h>
+#include <mm/tlb.h>
+#include <mm/vmalloc.h>
+#include <mm/vmm.h>
+#include <string.h>
+
+/*
+ * Kernel VA allocator.
+ *
+ * free_vmap_root holds the free ranges sorted by start address, each node
+ * caching the largest range in its subtree (subtree_max_size), so the
+ * lowest range that fits a request is found by one walk from the root.
+ * Adjacent free ranges are merged as soon as an area is given back.
+ * busy_vmap_root holds the allocated areas sorted by start address.
+ */
+static struct rb_root free_vmap_root = RB_ROOT;
+static struct rb_root busy_vmap_root = RB_ROOT;
+
+/* descriptor pool, grown one page at a time above the arena */
+static struct vmap_area *va_pool;
+static u32 va_meta_end = VMAP_META_START;
+
+static vmalloc_stats_t vmap_stats;
+
+static inline u32 va_size(struct vmap_area *va)
+{
+	return va->va_end - va->va_start;
+}
+
+RB_DECLARE_CALLBACKS_MAX(static, free_vmap_augment, struct vmap_area, rb_node,
+			 u32, subtree_max_size, va_size)
+
+static inline u32 subtree_max(struct rb_node *node)
+{
+	return node ? rb_entry(node, struct vmap_area, rb_node)->subtree_max_size
+		    : 0;
+}
+
+static struct vmap_area *va_desc_alloc(void)
+{
+	if (!va_pool) {
+		if (va_meta_end >= VMAP_META_END) {
+			log(LOG_ERR, "VMALLOC: out of area descriptors");
+			return NULL;
+		}
+		u32 phys = pmm_alloc_page(PMM_ZONE_HIGH);
+		if (!phys)
+			return NULL;
+		if (vmm_map_page(va_meta_end, phys, PAGE_FLAGS_KERNEL)
+		    != KERNEL_OK) {
+			pmm_free_page(phys);
+			return NULL;
+		}
+
+		struct vmap_area *va = (struct vmap_area *)va_meta_end;
+		for (u32 i = 0; i < PAGE_SIZE / sizeof(*va); i++) {
+			va[i].next_free = va_pool;
+			va_pool = &va[i];
+		}
+		va_meta_end += PAGE_SIZE;
+	}
+
+	struct vmap_area *va = va_pool;
+	va_pool = va->next_free;
+	return va;
+}
+
+static void va_desc_free(struct vmap_area *va)
+{
+	va->next_free = va_pool;
+	va_pool = va;
+}
+
+/* Free tree */
+
+static void free_tree_insert(struct vmap_area *va)
+{
+	struct rb_node **link = &free_vmap_root.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*link) {
+		parent = *link;
+		struct vmap_area *p = rb_entry(parent, struct vmap_area, rb_node);
+		link = va->va_start < p->va_start ? &parent->rb_left
+						  : &parent->rb_right;
+	}
+
+	va->subtree_max_size = va_size(va);
+	rb_link_node(&va->rb_node, parent, link);
+	free_vmap_augment.propagate(parent, NULL);
+	rb_insert_augmented(&va->rb_node, &free_vmap_root, &free_vmap_augment);
+	vmap_stats.nr_free++;
+}
+
+static void free_tree_erase(struct vmap_area *va)
+{
+	rb_erase_augmented(&va->rb_node, &free_vmap_root, &free_vmap_augment);
+	vmap_stats.nr_free--;
+}
+
+/* Insert a free range and merge it with the free ranges on either side */
+static void free_tree_insert_merge(struct vmap_area *va)
+{
+	free_tree_insert(va);
+
+	struct rb_node *next = rb_next(&va->rb_node);
+	if (next) {
+		struct vmap_area *n = rb_entry(next, struct vmap_area, rb_node);
+		if (n->va_start == va->va_end) {
+			free_tree_erase(n);
+			va->va_end = n->va_end;
+			va_desc_free(n);
+			free_vmap_augment.propagate(&va->rb_node, NULL);
+		}
+	}
+
+	struct rb_node *prev = rb_prev(&va->rb_node);
+	if (prev) {
+		struct vmap_area *p = rb_entry(prev, struct vmap_area, rb_node);
+		if (p->va_end == va->va_start) {
+			free_tree_erase(va);
+			p->va_end = va->va_end;
+			va_desc_free(va);
+			free_vmap_augment.propagate(&p->rb_node, NULL);
+		}
+	}
+}
+
+/* Lowest free range that can hold size bytes at the given alignment. The
+ * walk prefers the left subtree whenever it is known to hold a range of
+ * size + align - PAGE_SIZE bytes, which fits at any alignment.
+ */
+static struct vmap_area *find_vmap_lowest_match(u32 size, u32 align)
+{
+	u32 length = size + align - PAGE_SIZE;
+	struct rb_node *node = free_vmap_root.rb_node;
+
+	if (subtree_max(node) < length)
+		return NULL;
+
+	while (node) {
+		struct vmap_area *va = rb_entry(node, struct vmap_area, rb_node);
+		if (subtree_max(node->rb_left) >= length) {
+			node = node->rb_left;
+			continue;
+		}
+
+		u32 start = ALIGN_UP(va->va_start, align);
+		if (start >= va->va_start && start < va->va_end
+		    && va->va_end - start >= size)
+			return va;
+		node = node->rb_right;
+	}
+	return NULL;
+}
+
+/* Take [start, end) out of the free range va */
+static kernel_status_t va_clip(struct vmap_area *va, u32 start, u32 end)
+{
+	if (start == va->va_start && end == va->va_end) {
+		free_tree_erase(va);
+		va_desc_free(va);
+	} else if (start == va->va_start) {
+		va->va_start = end;
+		free_vmap_augment.propagate(&va->rb_node, NULL);
+	} else if (end == va->va_end) {
+		va->va_end = start;
+		free_vmap_augment.propagate(&va->rb_node, NULL);
+	} else {
+		/* split: va keeps the head, a new range takes the tail */
+		struct vmap_area *tail = va_desc_alloc();
+		if (!tail)
+			return KERNEL_OUT_OF_MEMORY;
+		tail->va_start = end;
+		tail->va_end = va->va_end;
+		tail->flags = 0;
+		va->va_end = start;
+		free_vmap_augment.propagate(&va->rb_node, NULL);
+		free_tree_insert(tail);
+	}
+
+	vmap_stats.free_bytes -= end - start;
+	return KERNEL_OK;
+}
+
+/* Busy tree */
+
+static void busy_tree_insert(struct vmap_area *va)
+{
+	struct rb_node **link = &busy_vmap_root.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*link) {
+		parent = *link;
+		struct vmap_area *p = rb_entry(parent, struct vmap_area, rb_node);
+		link = va->va_start < p->va_start ? &parent->rb_left
+						  : &parent->rb_right;
+	}
+	rb_link_node(&va->rb_node, parent, link);
+	rb_insert_color(&va->rb_node, &busy_vmap_root);
+	vmap_stats.nr_busy++;
+}
+
+static struct vmap_area *busy_tree_find(u32 addr)
+{
+	struct rb_node *node = busy_vmap_root.rb_node;
+
+	while (node) {
+		struct vmap_area *va = rb_entry(node, struct vmap_area, rb_node);
+		if (addr < va->va_start)
+			node = node->rb_left;
+		else if (addr > va->va_start)
+			node = node->rb_right;
+		else
+			return va;
+	}
+	return NULL;
+}
+
+/* Public API */
+
+u32 alloc_vmap_area(u32 size, u32 align, u32 flags)
+{
+	size = ALIGN_UP(size, PAGE_SIZE);
+	align = MAX(ALIGN_UP(align, PAGE_SIZE), PAGE_SIZE);
+	if (size == 0 || size > VMALLOC_END - VMALLOC_START
+	    || align > VMALLOC_END - VMALLOC_START || (align & (align - 1)))
+		return 0;
+
+	struct vmap_area *busy = va_desc_alloc();
+	if (!busy)
+		return 0;
+
+	struct vmap_area *va = find_vmap_lowest_match(size, align);
+	u32 start = va ? ALIGN_UP(va->va_start, align) : 0;
+	if (!va || va_clip(va, start, start + size) != KERNEL_OK) {
+		va_desc_free(busy);
+		log(LOG_WARN, "VMALLOC: no room for %u bytes (align 0x%x)",
+		    size, align);
+		return 0;
+	}
+
+	busy->va_start = start;
+	busy->va_end = start + size;
+	busy->flags = flags;
+	busy_tree_insert(busy);
+	vmap_stats.used_bytes += size;
+	return start;
+}
+
+void free_vmap_area(u32 addr)
+{
+	struct vmap_area *va = busy_tree_find(addr);
+	if (!va) {
+		log(LOG_WARN, "VMALLOC: free of unknown area 0x%x", addr);
+		return;
+	}
+
+	rb_erase(&va->rb_node, &busy_vmap_root);
+	vmap_stats.nr_busy--;
+	vmap_stats.used_bytes -= va_size(va);
+	vmap_stats.free_bytes += va_size(va);
+	va->flags = 0;
+	free_tree_insert_merge(va);
+}
+
+kernel_status_t vmap_reserve(u32 start, u32 size)
+{
+	u32 end = size > VMALLOC_END - MIN(start, VMALLOC_END)
+			  ? VMALLOC_END
+			  : start + size;
+	start = MAX(ALIGN_DOWN(start, PAGE_SIZE), VMALLOC_START);
+	end = MIN(ALIGN_UP(end, PAGE_SIZE), VMALLOC_END);
+
+	struct rb_node *node = rb_first(&free_vmap_root);
+	while (node && start < end) {
+		struct vmap_area *va = rb_entry(node, struct vmap_area, rb_node);
+		/* va may be released or split by the clip below */
+		struct rb_node *next = rb_next(node);
+		if (va->va_start >= end)
+			break;
+		if (va->va_end > start) {
+			u32 s = MAX(start, va->va_start);
+			u32 e = MIN(end, va->va_end);
+			kernel_status_t status = va_clip(va, s, e);
+			if (status != KERNEL_OK)
+				return status;
+			vmap_stats.reserved_bytes += e - s;
+		}
+		node = next;
+	}
+	return KERNEL_OK;
+}
+
+kernel_status_t vmalloc_init(void)
+{
+	struct vmap_area *va = va_desc_alloc();
+	if (!va)
+		return KERNEL_OUT_OF_MEMORY;
+	va->va_start = VMALLOC_START;
+	va->va_end = VMALLOC_END;
+	va->flags = 0;
+	free_tree_insert(va);
+	vmap_stats.free_bytes = VMALLOC_END - VMALLOC_START;
+
+	/* keep whatever vmm_init already mapped here (the identity mapped
+	 * framebuffer and boot structures)
+	 */
+	u32 addr = VMALLOC_START;
+	while (addr < VMALLOC_END) {
+		if (!vmm_pde_present(addr)) {
+			addr = ALIGN_DOWN(addr, LARGE_PAGE_SIZE) + LARGE_PAGE_SIZE;
+			continue;
+		}
+		u32 start = addr;
+		while (addr < VMALLOC_END && vmm_get_physical_addr(addr))
+			addr += PAGE_SIZE;
+		if (addr > start) {
+			kernel_status_t status = vmap_reserve(start, addr - start);
+			if (status != KERNEL_OK)
+				return status;
+		} else {
+			addr += PAGE_SIZE;
+		}
+	}
+
+	log(LOG_OKAY, "VMALLOC: arena 0x%x-0x%x, %u KiB in use at boot",
+	    VMALLOC_START, VMALLOC_END, vmap_stats.reserved_bytes / 1024);
+	return KERNEL_OK;
+}
+
+/* Unmap pages of an area; vmalloc frames are released after the flush */
+static void vmap_unmap_area(u32 start, u32 size, bool free_frames)
+{
+	struct mmu_gather tlb;
+
+	if (size == 0)
+		return;
+	tlb_gather_mmu(&tlb, free_frames);
+	vmm_unmap_range_gather(&tlb, start, size);
+	tlb_finish_mmu(&tlb);
+}
+
+/* Usable bytes of an area, without its guard page */
+static inline u32 vmap_area_usable(struct vmap_area *va)
+{
+	return va_size(va) - ((va->flags & VMAP_GUARD) ? PAGE_SIZE : 0);
+}
+
+void *vmalloc(size_t size)
+{
+	if (size == 0 || size > VMALLOC_END - VMALLOC_START - PAGE_SIZE)
+		return NULL;
+
+	/* one unmapped guard page behind the area catches overruns */
+	u32 nr_pages = ALIGN_UP(size, PAGE_SIZE) / PAGE_SIZE;
+	u32 addr = alloc_vmap_area((nr_pages + 1) * PAGE_SIZE, PAGE_SIZE,
+				   VMAP_VMALLOC | VMAP_GUARD);
+	if (!addr)
+		return NULL;
+
+	for (u32 i = 0; i < nr_pages; i++) {
+		u32 phys = pmm_alloc_page(PMM_ZONE_HIGH);
+		if (!phys
+		    || vmm_map_page(addr + i * PAGE_SIZE, phys,
+				    PAGE_FLAGS_KERNEL) != KERNEL_OK) {
+			if (phys)
+				pmm_free_page(phys);
+			vmap_unmap_area(addr, i * PAGE_SIZE, true);
+			vmap_stats.vmalloc_pages -= i;
+			free_vmap_area(addr);
+			return NULL;
+		}
+		page_set_owner(phys, PG_VMALLOC, NULL);
+		vmap_stats.vmalloc_pages++;
+	}
+	return (void *)addr;
+}
+
+void *vzalloc(size_t size)
+{
+	void *ptr = vmalloc(size);
+	if (ptr)
+		memset(ptr, 0, size);
+	return ptr;
+}
+
+void vfree(const void *addr)
+{
+	if (!addr)
+		return;
+
+	struct vmap_area *va = busy_tree_find((u32)addr);
+	if (!va || !(va->flags & VMAP_VMALLOC)) {
+		log(LOG_WARN, "VMALLOC: vfree of non-vmalloc address 0x%x",
+		    (u32)addr);
+		return;
+	}
+	u32 usable = vmap_area_usable(va);
+	vmap_unmap_area(va->va_start, usable, true);
+	vmap_stats.vmalloc_pages -= usable / PAGE_SIZE;
+	free_vmap_area(va->va_start);
+}
+
+void *vmap(const u32 *frames, u32 count, u32 page_flags)
+{
+	if (!frames || count == 0
+	    || count >= (VMALLOC_END - VMALLOC_START) / PAGE_SIZE)
+		return NULL;
+
+	u32 addr = alloc_vmap_area((count + 1) * PAGE_SIZE, PAGE_SIZE,
+				   VMAP_VMAP | VMAP_GUARD);
+	if (!addr)
+		return NULL;
+
+	u32 flags = PAGE_FLAGS_KERNEL | (page_flags & PAGE_CACHE_MASK);
+	for (u32 i = 0; i < count; i++) {
+		if (vmm_map_page(addr + i * PAGE_SIZE, frames[i] & ~0xFFF, flags)
+		    != KERNEL_OK) {
+			vmap_unmap_area(addr, i * PAGE_SIZE, false);
+			free_vmap_area(addr);
+			return NULL;
+		}
+	}
+	return (void *)addr;
+}
+
+void vunmap(const void *addr)
+{
+	if (!addr)
+		return;
+
+	struct vmap_area *va = busy_tree_find((u32)addr);
+	if (!va || !(va->flags & VMAP_VMAP)) {
+		log(LOG_WARN, "VMALLOC: vunmap of non-vmap address 0x%x",
+		    (u32)addr);
+		return;
+	}
+	vmap_unmap_area(va->va_start, vmap_area_usable(va), false);
+	free_vmap_area(va->va_start);
+}
+
+bool is_vmalloc_addr(const void *addr)
+{
+	struct vmap_area *va = busy_tree_find((u32)addr);
+	return va && (va->flags & (VMAP_VMALLOC | VMAP_VMAP));
+}
+
+size_t vmalloc_size(const void *addr)
+{
+	struct vmap_area *va = busy_tree_find((u32)addr);
+	if (!va || !(va->flags & VMAP_VMALLOC))
+		return 0;
+	return vmap_area_usable(va);
+}
+
+void vmalloc_get_stats(vmalloc_stats_t *stats)
+{
+	if (!stats)
+		return;
+	*stats = vmap_stats;
+	stats->largest_free = subtree_max(free_vmap_root.rb_node);
+}
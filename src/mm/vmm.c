@@ -1,7 +1,11 @@
+#include <arch/i386/cpuid.h>
 #include <drivers/vbe.h>
 #include <kernel/kernel.h>
 #include <misc/logger.h>
 #include <mm/bitmap.h>
+#include <mm/page.h>
+#include <mm/tlb.h>
+#include <mm/vmalloc.h>
 #include <mm/vmm.h>
 #include <printf.h>
 #include <string.h>
@@ -12,12 +16,63 @@ page_directory_t kernel_page_directory;
 #define PAGE_RECURSIVE_PD 0xFFFFF000
 #define PAGE_RECURSIVE_PT_BASE 0xFFC00000
 
+#define LARGE_PAGE_MASK (~(LARGE_PAGE_SIZE - 1))
+#define CR4_PSE (1 << 4)
+#define CR4_PGE (1 << 7)
+
+#define MSR_IA32_PAT 0x277
+#define PAT_TYPE_WC 0x01ULL
+#define PAT_ENTRY_SHIFT(n) ((n) * 8)
+
+/* Set once CR4.PSE is on; 4 MiB PDEs are only created after that */
+static bool pse_enabled = false;
+/* Set once CR4.PGE is on; PAGE_FLAG_GLOBAL entries survive CR3 reloads */
+static bool pge_enabled = false;
+/* Set once PAT entry 1 is write-combining, see PAGE_FLAG_WC */
+static bool pat_enabled = false;
+/* Bytes of framebuffer mapped by vmm_init, rounded to whole large pages */
+static u32 fb_map_size = 0;
+
 /* Invalidate a single page in the TLB for virtual address va */
 static inline void tlb_invlpg(u32 va)
 {
 	__asm__ volatile("invlpg (%0)" ::"r"(va) : "memory");
 }
 
+static inline u32 read_cr4(void)
+{
+	u32 cr4;
+	__asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+	return cr4;
+}
+
+static inline void write_cr4(u32 cr4)
+{
+	__asm__ volatile("mov %0, %%cr4" ::"r"(cr4) : "memory");
+}
+
+void vmm_flush_tlb(void)
+{
+	u32 cr3;
+	__asm__ volatile("mov %%cr3, %0\n\t"
+			 "mov %0, %%cr3"
+			 : "=r"(cr3)
+			 :
+			 : "memory");
+}
+
+void vmm_flush_tlb_all(void)
+{
+	if (!pge_enabled) {
+		vmm_flush_tlb();
+		return;
+	}
+	/* toggling CR4.PGE invalidates global entries as well */
+	u32 cr4 = read_cr4();
+	write_cr4(cr4 & ~CR4_PGE);
+	write_cr4(cr4);
+}
+
 /* Returns true if paging is currently enabled (CR0.PG set) */
 static bool is_paging_enabled(void)
 {
@@ -26,65 +81,147 @@ static bool is_paging_enabled(void)
 	return (cr0 & 0x80000000) != 0;
 }
 
-kernel_status_t vmm_init(void)
+/* Page directory, through the recursive slot once paging is on */
+static u32 *vmm_pd(void)
 {
-	memset(kernel_page_directory, 0, sizeof(page_directory_t));
+	return is_paging_enabled() ? (u32 *)PAGE_RECURSIVE_PD
+				   : kernel_page_directory;
+}
 
-	extern u32 _kernel_end;
-	u32 kernel_start = 0x00100000;
-	u32 kernel_size = (u32)&_kernel_end - kernel_start;
-	u32 num_pages = ALIGN_UP(kernel_size, PAGE_SIZE) / PAGE_SIZE;
+/* Page table behind pd_index; the PDE must be present and not large */
+static u32 *vmm_pt(u32 pd_index)
+{
+	if (is_paging_enabled())
+		return (u32 *)(PAGE_RECURSIVE_PT_BASE + (pd_index << 12));
+	return (u32 *)(kernel_page_directory[pd_index] & ~0xFFF);
+}
 
-	for (u32 i = 0; i < num_pages; ++i) {
-		u32 virt = kernel_start + i * PAGE_SIZE;
-		u32 phys = virt;
-		vmm_map_page(virt, phys, PAGE_FLAG_PRESENT | PAGE_FLAG_RW);
-	}
+/*
+ * Page table frames keep the number of present entries in their struct
+ * page, so a table can be released as soon as its last PTE goes away.
+ */
+static inline u32 *pt_present_count(u32 pde)
+{
+	return &phys_to_page(pde & ~0xFFF)->private;
+}
 
-	u32 bitmap_start = (u32)g_physical_allocator.bits;
-	u32 bitmap_size = g_physical_allocator.size;
-	u32 bitmap_pages = ALIGN_UP(bitmap_size, PAGE_SIZE) / PAGE_SIZE;
+/* Allocate an empty page table frame and tag it in the page database */
+static u32 vmm_alloc_pt(void)
+{
+	/* unmapping can need a table too (splitting a large page), so
+	 * tables may dip into the reserve
+	 */
+	u32 pt_phys = pmm_alloc_zeroed_page(PMM_ZONE_HIGH | PMM_ALLOC_RESERVE);
+	if (!pt_phys)
+		return 0;
+	page_set_owner(pt_phys, PG_PAGETABLE, NULL);
+	phys_to_page(pt_phys)->private = 0;
+	return pt_phys;
+}
 
-	for (u32 i = 0; i < bitmap_pages; ++i) {
-		u32 virt = bitmap_start + i * PAGE_SIZE;
-		u32 phys = virt;
-		kernel_status_t status = vmm_map_page(
-			virt, phys, PAGE_FLAG_PRESENT | PAGE_FLAG_RW);
-		if (status != KERNEL_OK) {
-			return status;
-		}
+/* Detach and free the page table behind pd_index. With a gather the frame
+ * is only released after the gather's flush. The temp slot keeps its table
+ * for good since vmm_map_temp() must never allocate.
+ */
+static void vmm_free_pt(u32 *pd, u32 pd_index, struct mmu_gather *tlb)
+{
+	if (pd_index == (VMM_TEMP_MAP_ADDR >> 22))
+		return;
+
+	u32 pt_phys = pd[pd_index] & ~0xFFF;
+	u32 window = (u32)vmm_pt(pd_index);
+	pd[pd_index] = 0;
+	if (is_paging_enabled())
+		tlb_invlpg(window);
+	if (tlb)
+		tlb_remove_table(tlb, pt_phys);
+	else
+		pmm_free_page(pt_phys);
+}
+
+/* Turn on the paging extensions the CPU supports */
+static void vmm_enable_cpu_features(void)
+{
+	u32 cr4 = read_cr4();
+
+	if (cpuid_has_feature_edx(CPUID_FEAT_EDX_PSE)) {
+		cr4 |= CR4_PSE;
+		pse_enabled = true;
+	} else {
+		log(LOG_WARN, "VMM: no PSE, using 4 KiB pages only");
 	}
 
-	if (vbe_is_available()) {
-		vbe_device_t *dev = vbe_get_device();
-		u32 fb_pages = ALIGN_UP(dev->framebuffer_size, PAGE_SIZE)
-			       / PAGE_SIZE;
-		for (u32 i = 0; i < fb_pages; ++i) {
-			u32 virt = dev->framebuffer_addr + i * PAGE_SIZE;
-			vmm_map_page(virt, virt,
-				     PAGE_FLAG_PRESENT | PAGE_FLAG_RW);
-		}
+	if (cpuid_has_feature_edx(CPUID_FEAT_EDX_PGE)) {
+		cr4 |= CR4_PGE;
+		pge_enabled = true;
+	} else {
+		log(LOG_WARN, "VMM: no PGE, kernel TLB entries are not global");
 	}
 
-	u32 low_pt_phys;
-	if (!(kernel_page_directory[0] & PAGE_FLAG_PRESENT)) {
-		low_pt_phys = pmm_alloc_page();
-		if (!low_pt_phys) return KERNEL_OUT_OF_MEMORY;
-		if (low_pt_phys == 0)
-			return KERNEL_OUT_OF_MEMORY;
-		kernel_page_directory[0]
-			= low_pt_phys | PAGE_FLAG_PRESENT | PAGE_FLAG_RW;
-		memset((void *)low_pt_phys, 0, PAGE_SIZE);
+	write_cr4(cr4);
+
+	/* Runs before paging and before any mapping uses PWT, so no cached
+	 * line or TLB entry can carry the old type of PAT entry 1.
+	 */
+	if (cpuid_has_feature_edx(CPUID_FEAT_EDX_PAT)) {
+		u64 pat = rdmsr(MSR_IA32_PAT);
+		pat &= ~(0xFFULL << PAT_ENTRY_SHIFT(1));
+		pat |= PAT_TYPE_WC << PAT_ENTRY_SHIFT(1);
+		wrmsr(MSR_IA32_PAT, pat);
+		__asm__ volatile("wbinvd" ::: "memory");
+		pat_enabled = true;
 	} else {
-		low_pt_phys = kernel_page_directory[0] & ~0xFFF;
+		log(LOG_WARN, "VMM: no PAT, framebuffer stays uncached");
 	}
+}
 
-	u32 *low_pt = (u32 *)low_pt_phys;
-	for (u32 i = 0; i < 256; i++) {
-		if (!(low_pt[i] & PAGE_FLAG_PRESENT)) {
-			low_pt[i] = (i * PAGE_SIZE) | PAGE_FLAG_PRESENT
-				    | PAGE_FLAG_RW;
-		}
+bool vmm_large_pages_enabled(void)
+{
+	return pse_enabled;
+}
+
+bool vmm_pat_enabled(void)
+{
+	return pat_enabled;
+}
+
+u32 vmm_fb_map_size(void)
+{
+	return fb_map_size;
+}
+
+kernel_status_t vmm_init(void)
+{
+	kernel_status_t status;
+
+	vmm_enable_cpu_features();
+	memset(kernel_page_directory, 0, sizeof(page_directory_t));
+
+	/* Identity map low memory, the kernel image and the PMM metadata in
+	 * one range. With PSE the range is rounded up to whole 4 MiB pages.
+	 */
+	u32 ident_end = g_physical_allocator.meta_start
+			+ g_physical_allocator.meta_size;
+	if (pse_enabled)
+		ident_end = ALIGN_UP(ident_end, LARGE_PAGE_SIZE);
+	status = vmm_map_range(0, 0, ident_end, PAGE_FLAGS_KERNEL);
+	if (status != KERNEL_OK)
+		return status;
+
+	if (vbe_is_available()) {
+		vbe_device_t *dev = vbe_get_device();
+		u32 fb_addr = dev->framebuffer_addr;
+		u32 fb_size = dev->framebuffer_size;
+		u32 vram_size = (u32)dev->control_info.total_memory * 0x10000;
+
+		/* Round up to a 4 MiB page as long as it stays inside VRAM */
+		if (pse_enabled && !(fb_addr & (LARGE_PAGE_SIZE - 1))
+		    && ALIGN_UP(fb_size, LARGE_PAGE_SIZE) <= vram_size)
+			fb_size = ALIGN_UP(fb_size, LARGE_PAGE_SIZE);
+		vmm_map_range(fb_addr, fb_addr, fb_size, PAGE_FLAGS_KERNEL);
+		fb_map_size = fb_size;
+		if (pat_enabled)
+			vmm_set_cache_attr(fb_addr, fb_size, PAGE_FLAG_WC);
 	}
 
 	extern u32 _multiboot_info_ptr;
@@ -95,8 +232,7 @@ kernel_status_t vmm_init(void)
 				/ PAGE_SIZE;
 		for (u32 i = 0; i < mbi_pages; ++i) {
 			u32 virt = mbi_addr + i * PAGE_SIZE;
-			vmm_map_page(virt, virt,
-				     PAGE_FLAG_PRESENT | PAGE_FLAG_RW);
+			vmm_map_page(virt, virt, PAGE_FLAGS_KERNEL);
 		}
 
 		u32 vbe_control_addr = mbi->vbe_control_info;
@@ -105,8 +241,7 @@ kernel_status_t vmm_init(void)
 			  / PAGE_SIZE;
 		for (u32 i = 0; i < vbe_control_pages; ++i) {
 			u32 virt = vbe_control_addr + i * PAGE_SIZE;
-			vmm_map_page(virt, virt,
-				     PAGE_FLAG_PRESENT | PAGE_FLAG_RW);
+			vmm_map_page(virt, virt, PAGE_FLAGS_KERNEL);
 		}
 
 		u32 vbe_mode_addr = mbi->vbe_mode_info;
@@ -115,8 +250,7 @@ kernel_status_t vmm_init(void)
 			  / PAGE_SIZE;
 		for (u32 i = 0; i < vbe_mode_pages; ++i) {
 			u32 virt = vbe_mode_addr + i * PAGE_SIZE;
-			vmm_map_page(virt, virt,
-				     PAGE_FLAG_PRESENT | PAGE_FLAG_RW);
+			vmm_map_page(virt, virt, PAGE_FLAGS_KERNEL);
 		}
 
 		vbe_device_t *dev = vbe_get_device();
@@ -126,12 +260,24 @@ kernel_status_t vmm_init(void)
 		video_modes_addr = seg * 16 + off;
 		vmm_map_page(ALIGN_DOWN(video_modes_addr, PAGE_SIZE),
 			     ALIGN_DOWN(video_modes_addr, PAGE_SIZE),
-			     PAGE_FLAG_PRESENT | PAGE_FLAG_RW);
+			     PAGE_FLAGS_KERNEL);
 
 		u32 oem_string_addr = dev->control_info.oem_string_ptr;
 		vmm_map_page(ALIGN_DOWN(oem_string_addr, PAGE_SIZE),
 			     ALIGN_DOWN(oem_string_addr, PAGE_SIZE),
-			     PAGE_FLAG_PRESENT | PAGE_FLAG_RW);
+			     PAGE_FLAGS_KERNEL);
+	}
+
+	/* Give the temporary mapping slot its page table up front, so that
+	 * vmm_map_temp() never needs to allocate.
+	 */
+	u32 temp_pd_index = VMM_TEMP_MAP_ADDR >> 22;
+	if (!(kernel_page_directory[temp_pd_index] & PAGE_FLAG_PRESENT)) {
+		u32 temp_pt_phys = vmm_alloc_pt();
+		if (!temp_pt_phys)
+			return KERNEL_OUT_OF_MEMORY;
+		kernel_page_directory[temp_pd_index]
+			= temp_pt_phys | PAGE_FLAG_PRESENT | PAGE_FLAG_RW;
 	}
 
 	kernel_page_directory[PAGE_RECURSIVE_SLOT] = (u32)&kernel_page_directory
@@ -140,7 +286,9 @@ kernel_status_t vmm_init(void)
 
 	vmm_switch_directory(&kernel_page_directory);
 	vmm_enable_paging();
-	log(LOG_OKAY, "VMM: paging enabled");
+	log(LOG_OKAY, "VMM: paging enabled (PSE %s, PGE %s, PAT %s)",
+	    pse_enabled ? "on" : "off", pge_enabled ? "on" : "off",
+	    pat_enabled ? "on" : "off");
 	return KERNEL_OK;
 }
 
@@ -148,44 +296,105 @@ kernel_status_t vmm_map_page(u32 virt_addr, u32 phys_addr, u32 flags)
 {
 	u32 pd_index = virt_addr >> 22;
 	u32 pt_index = (virt_addr >> 12) & 0x3FF;
+	u32 *pd = vmm_pd();
+
+	if (pd[pd_index] & PAGE_FLAG_LARGE) {
+		/* already covered by a 4 MiB page: fine if it translates the
+		 * same way
+		 */
+		u32 cur = (pd[pd_index] & LARGE_PAGE_MASK)
+			  | (virt_addr & ~LARGE_PAGE_MASK & ~0xFFF);
+		return cur == (phys_addr & ~0xFFF) ? KERNEL_OK
+						   : KERNEL_ALREADY_MAPPED;
+	}
 
-	if (is_paging_enabled()) {
-		u32 *pd = (u32 *)PAGE_RECURSIVE_PD;
-		if (!(pd[pd_index] & PAGE_FLAG_PRESENT)) {
-			u32 pt_phys = pmm_alloc_page();
-			if (!pt_phys)
-				return KERNEL_OUT_OF_MEMORY;
-			tlb_invlpg((u32)(PAGE_RECURSIVE_PT_BASE + (pd_index << 12)));
-			pd[pd_index] = (pt_phys & ~0xFFF) | PAGE_FLAG_PRESENT
-				       | PAGE_FLAG_RW;
-			memset((void *)(PAGE_RECURSIVE_PT_BASE
-					+ (pd_index << 12)),
-			       0, PAGE_SIZE);
-		}
-		u32 *pt = (u32 *)(PAGE_RECURSIVE_PT_BASE + (pd_index << 12));
-		u32 newpte = (phys_addr & ~0xFFF) | (flags & PTE_FLAGS_MASK);
-		if ((pt[pt_index] & PAGE_FLAG_PRESENT)
-		    && ((pt[pt_index] & ~0xFFF) != (phys_addr & ~0xFFF))) {
+	if (!(pd[pd_index] & PAGE_FLAG_PRESENT)) {
+		u32 pt_phys = vmm_alloc_pt();
+		if (!pt_phys)
+			return KERNEL_OUT_OF_MEMORY;
+		pd[pd_index] = (pt_phys & ~0xFFF) | PAGE_FLAG_PRESENT
+			       | PAGE_FLAG_RW;
+		if (is_paging_enabled())
+			tlb_invlpg((u32)vmm_pt(pd_index));
+	}
+
+	u32 *pt = vmm_pt(pd_index);
+	if (pt[pt_index] & PAGE_FLAG_PRESENT) {
+		if ((pt[pt_index] & ~0xFFF) != (phys_addr & ~0xFFF))
 			return KERNEL_ALREADY_MAPPED;
-		}
-		pt[pt_index] = newpte;
-		tlb_invlpg(virt_addr);
 	} else {
-		if (!(kernel_page_directory[pd_index] & PAGE_FLAG_PRESENT)) {
-			u32 pt_phys = pmm_alloc_page();
-			if (!pt_phys)
-				return KERNEL_OUT_OF_MEMORY;
-			kernel_page_directory[pd_index] = (pt_phys & ~0xFFF)
-							  | PAGE_FLAG_PRESENT
-							  | PAGE_FLAG_RW;
-			memset((void *)(pt_phys), 0, PAGE_SIZE);
+		(*pt_present_count(pd[pd_index]))++;
+	}
+	pt[pt_index] = (phys_addr & ~0xFFF) | (flags & PTE_FLAGS_MASK);
+	if (is_paging_enabled())
+		tlb_invlpg(virt_addr);
+	return KERNEL_OK;
+}
+
+kernel_status_t vmm_map_large(u32 virt_addr, u32 phys_addr, u32 flags)
+{
+	if (!pse_enabled)
+		return KERNEL_NOT_IMPLEMENTED;
+	if ((virt_addr | phys_addr) & (LARGE_PAGE_SIZE - 1))
+		return KERNEL_INVALID_PARAM;
+
+	u32 pd_index = virt_addr >> 22;
+	u32 *pd = vmm_pd();
+	u32 old = pd[pd_index];
+
+	if (old & PAGE_FLAG_LARGE) {
+		if ((old & LARGE_PAGE_MASK) != phys_addr)
+			return KERNEL_ALREADY_MAPPED;
+	} else if (old & PAGE_FLAG_PRESENT) {
+		/* fold a page table only if nothing in it would change */
+		u32 *pt = vmm_pt(pd_index);
+		for (u32 i = 0; i < PAGE_TABLE_ENTRIES; i++) {
+			if ((pt[i] & PAGE_FLAG_PRESENT)
+			    && (pt[i] & ~0xFFF) != phys_addr + i * PAGE_SIZE)
+				return KERNEL_ALREADY_MAPPED;
 		}
-		u32 *pt = (u32 *)(kernel_page_directory[pd_index] & ~0xFFF);
-		pt[pt_index] = (phys_addr & ~0xFFF) | (flags & PTE_FLAGS_MASK);
+	}
+
+	pd[pd_index] = phys_addr | (flags & PTE_FLAGS_MASK) | PAGE_FLAG_LARGE;
+
+	if (old & PAGE_FLAG_PRESENT) {
+		/* stale 4 KiB entries anywhere in the 4 MiB range */
+		if (is_paging_enabled())
+			vmm_flush_tlb_all();
+		if (!(old & PAGE_FLAG_LARGE))
+			pmm_free_page(old & ~0xFFF);
 	}
 	return KERNEL_OK;
 }
 
+/* Replace the 4 MiB page at pd_index by a page table with the same
+ * translation, so that single 4 KiB pages in it can be changed.
+ */
+static kernel_status_t vmm_split_large(u32 pd_index)
+{
+	u32 *pd = vmm_pd();
+	u32 pde = pd[pd_index];
+	u32 base = pde & LARGE_PAGE_MASK;
+	u32 flags = pde & PTE_FLAGS_MASK;
+
+	u32 pt_phys = vmm_alloc_pt();
+	if (!pt_phys)
+		return KERNEL_OUT_OF_MEMORY;
+
+	/* fill the table before it becomes visible */
+	u32 *pt = vmm_map_temp(pt_phys);
+	for (u32 i = 0; i < PAGE_TABLE_ENTRIES; i++)
+		pt[i] = (base + i * PAGE_SIZE) | flags;
+	vmm_unmap_temp();
+	*pt_present_count(pt_phys) = PAGE_TABLE_ENTRIES;
+
+	pd[pd_index] = pt_phys | PAGE_FLAG_PRESENT | PAGE_FLAG_RW
+		       | (pde & PAGE_FLAG_USER);
+	if (is_paging_enabled())
+		vmm_flush_tlb_all();
+	return KERNEL_OK;
+}
+
 kernel_status_t vmm_map_pages(u32 virt_addr, u32 phys_addr, u32 count,
 			      u32 flags)
 {
@@ -203,9 +412,19 @@ kernel_status_t vmm_map_pages(u32 virt_addr, u32 phys_addr, u32 count,
 	return KERNEL_OK;
 }
 
+/* Step size vmm_map_range() uses at virt/phys with remaining bytes left */
+static u32 vmm_range_step(u32 virt, u32 phys, u32 remaining)
+{
+	if (pse_enabled && !((virt | phys) & (LARGE_PAGE_SIZE - 1))
+	    && remaining >= LARGE_PAGE_SIZE)
+		return LARGE_PAGE_SIZE;
+	return PAGE_SIZE;
+}
+
 /* Convenience: map a page-aligned range of bytes; requires page-aligned
  * virt_start and phys_start. Returns KERNEL_INVALID_PARAM if inputs are not
- * page-aligned.
+ * page-aligned. Chunks that are 4 MiB aligned in both address spaces are
+ * mapped with large pages when PSE is available.
  */
 kernel_status_t vmm_map_range(u32 virt_start, u32 phys_start, u32 size,
 			      u32 flags)
@@ -215,10 +434,36 @@ kernel_status_t vmm_map_range(u32 virt_start, u32 phys_start, u32 size,
 	if (size == 0)
 		return KERNEL_INVALID_PARAM;
 
-	u32 start = virt_start;
-	u32 end = ALIGN_UP(virt_start + size, PAGE_SIZE);
-	u32 pages = (end - start) / PAGE_SIZE;
-	return vmm_map_pages(start, phys_start, pages, flags);
+	u32 len = ALIGN_UP(size, PAGE_SIZE);
+	u32 done = 0;
+	while (done < len) {
+		u32 virt = virt_start + done;
+		u32 phys = phys_start + done;
+		u32 step = vmm_range_step(virt, phys, len - done);
+		kernel_status_t status
+			= step == LARGE_PAGE_SIZE
+				  ? vmm_map_large(virt, phys, flags)
+				  : vmm_map_page(virt, phys, flags);
+		if (status != KERNEL_OK) {
+			/* roll back with the same chunking */
+			for (u32 off = 0; off < done;) {
+				u32 v = virt_start + off;
+				u32 st = vmm_range_step(v, phys_start + off,
+							len - off);
+				if (st == LARGE_PAGE_SIZE) {
+					vmm_pd()[v >> 22] = 0;
+					if (is_paging_enabled())
+						vmm_flush_tlb_all();
+				} else {
+					vmm_unmap_page(v);
+				}
+				off += st;
+			}
+			return status;
+		}
+		done += step;
+	}
+	return KERNEL_OK;
 }
 
 /* Check if all pages in the virtual range are mapped. Returns true if every
@@ -243,30 +488,27 @@ kernel_status_t vmm_unmap_page(u32 virt_addr)
 {
 	u32 pd_index = virt_addr >> 22;
 	u32 pt_index = (virt_addr >> 12) & 0x3FF;
+	u32 *pd = vmm_pd();
 
-	if (is_paging_enabled()) {
-		u32 *pd = (u32 *)PAGE_RECURSIVE_PD;
-		if (!(pd[pd_index] & PAGE_FLAG_PRESENT)) {
-			return KERNEL_INVALID_PARAM;
-		}
-		u32 *pt = (u32 *)(PAGE_RECURSIVE_PT_BASE + (pd_index << 12));
-		if (!(pt[pt_index] & PAGE_FLAG_PRESENT)) {
-			return KERNEL_INVALID_PARAM;
-		}
-		pt[pt_index] = 0;
-	} else {
-		if (!(kernel_page_directory[pd_index] & PAGE_FLAG_PRESENT)) {
-			return KERNEL_INVALID_PARAM;
-		}
-		u32 *pt = (u32 *)(kernel_page_directory[pd_index] & ~0xFFF);
-		if (!(pt[pt_index] & PAGE_FLAG_PRESENT)) {
-			return KERNEL_INVALID_PARAM;
-		}
-		pt[pt_index] = 0;
+	if (!(pd[pd_index] & PAGE_FLAG_PRESENT)) {
+		return KERNEL_INVALID_PARAM;
+	}
+	if (pd[pd_index] & PAGE_FLAG_LARGE) {
+		kernel_status_t status = vmm_split_large(pd_index);
+		if (status != KERNEL_OK)
+			return status;
+	}
+	u32 *pt = vmm_pt(pd_index);
+	if (!(pt[pt_index] & PAGE_FLAG_PRESENT)) {
+		return KERNEL_INVALID_PARAM;
 	}
+	pt[pt_index] = 0;
 
 	__asm__ volatile("invlpg (%0)" : : "r"(virt_addr) : "memory");
 
+	if (--(*pt_present_count(pd[pd_index])) == 0)
+		vmm_free_pt(pd, pd_index, NULL);
+
 	return KERNEL_OK;
 }
 
@@ -279,30 +521,108 @@ kernel_status_t vmm_unmap_pages(u32 virt_addr, u32 count)
 			return status;
 		}
 	}
+	return KERNEL_OK;
+}
 
-	if (is_paging_enabled()) {
-		u32 *pd = (u32 *)PAGE_RECURSIVE_PD;
-		for (u32 i = 0; i < count; i++) {
-			u32 pd_index = (virt_addr + i * PAGE_SIZE) >> 22;
-			u32 *pt = (u32 *)(PAGE_RECURSIVE_PT_BASE
-					  + (pd_index << 12));
-			bool empty = true;
-			for (u32 j = 0; j < PAGE_TABLE_ENTRIES; j++) {
-				if (pt[j] & PAGE_FLAG_PRESENT) {
-					empty = false;
-					break;
-				}
+kernel_status_t vmm_unmap_range(u32 virt_start, u32 size)
+{
+	struct mmu_gather tlb;
+
+	tlb_gather_mmu(&tlb, false);
+	kernel_status_t status = vmm_unmap_range_gather(&tlb, virt_start, size);
+	tlb_finish_mmu(&tlb);
+	return status;
+}
+
+kernel_status_t vmm_unmap_range_gather(struct mmu_gather *tlb, u32 virt_start,
+				       u32 size)
+{
+	if ((virt_start & (PAGE_SIZE - 1)) || size == 0)
+		return KERNEL_INVALID_PARAM;
+
+	u32 *pd = vmm_pd();
+	u32 virt = virt_start;
+	u32 remaining = ALIGN_UP(size, PAGE_SIZE) / PAGE_SIZE;
+
+	while (remaining > 0) {
+		u32 pd_index = virt >> 22;
+		u32 pt_index = (virt >> 12) & 0x3FF;
+		u32 n = MIN(remaining, PAGE_TABLE_ENTRIES - pt_index);
+
+		if ((pd[pd_index] & PAGE_FLAG_LARGE)
+		    && n == PAGE_TABLE_ENTRIES) {
+			/* whole 4 MiB page goes away, no table to split */
+			u32 pde = pd[pd_index];
+			pd[pd_index] = 0;
+			tlb_add_range(tlb, virt, LARGE_PAGE_SIZE,
+				      (pde & PAGE_FLAG_GLOBAL) != 0);
+		} else if (pd[pd_index] & PAGE_FLAG_LARGE) {
+			kernel_status_t status = vmm_split_large(pd_index);
+			if (status != KERNEL_OK)
+				return status;
+			continue;
+		} else if (pd[pd_index] & PAGE_FLAG_PRESENT) {
+			u32 *pt = vmm_pt(pd_index);
+			u32 *count = pt_present_count(pd[pd_index]);
+			for (u32 i = pt_index; i < pt_index + n; i++) {
+				if (!(pt[i] & PAGE_FLAG_PRESENT))
+					continue;
+				u32 pte = pt[i];
+				pt[i] = 0;
+				tlb_remove_pte(tlb, (pd_index << 22) | (i << 12),
+					       pte);
+				(*count)--;
 			}
-			if (empty && (pd[pd_index] & PAGE_FLAG_PRESENT)) {
-				u32 pt_phys = pd[pd_index] & ~0xFFF;
-				pd[pd_index] = 0;
-				pmm_free_page(pt_phys);
-				__asm__ volatile("invlpg (%0)"
-						 :
-						 : "r"((u32)pt)
-						 : "memory");
+			if (*count == 0)
+				vmm_free_pt(pd, pd_index, tlb);
+		}
+		virt += n * PAGE_SIZE;
+		remaining -= n;
+	}
+	return KERNEL_OK;
+}
+
+kernel_status_t vmm_set_cache_attr(u32 virt_start, u32 size, u32 cache_flags)
+{
+	if ((virt_start & (PAGE_SIZE - 1)) || size == 0)
+		return KERNEL_INVALID_PARAM;
+	if (cache_flags & ~PAGE_CACHE_MASK)
+		return KERNEL_INVALID_PARAM;
+
+	u32 *pd = vmm_pd();
+	u32 virt = virt_start;
+	u32 remaining = ALIGN_UP(size, PAGE_SIZE) / PAGE_SIZE;
+
+	while (remaining > 0) {
+		u32 pd_index = virt >> 22;
+		u32 pt_index = (virt >> 12) & 0x3FF;
+		u32 n = MIN(remaining, PAGE_TABLE_ENTRIES - pt_index);
+
+		if ((pd[pd_index] & PAGE_FLAG_LARGE)
+		    && n == PAGE_TABLE_ENTRIES) {
+			pd[pd_index] = (pd[pd_index] & ~PAGE_CACHE_MASK)
+				       | cache_flags;
+		} else if (pd[pd_index] & PAGE_FLAG_LARGE) {
+			/* only part of the 4 MiB page changes type */
+			kernel_status_t status = vmm_split_large(pd_index);
+			if (status != KERNEL_OK)
+				return status;
+			continue;
+		} else if (pd[pd_index] & PAGE_FLAG_PRESENT) {
+			u32 *pt = vmm_pt(pd_index);
+			for (u32 i = pt_index; i < pt_index + n; i++) {
+				if (pt[i] & PAGE_FLAG_PRESENT)
+					pt[i] = (pt[i] & ~PAGE_CACHE_MASK)
+						| cache_flags;
 			}
 		}
+		virt += n * PAGE_SIZE;
+		remaining -= n;
+	}
+
+	if (is_paging_enabled()) {
+		vmm_flush_tlb_all();
+		__asm__ volatile("wbinvd" ::: "memory");
 	}
 	return KERNEL_OK;
 }
@@ -313,16 +633,18 @@ kernel_status_t vmm_map_if_not_mapped(u32 phys_start, u32 size)
 	u32 end = ALIGN_UP(phys_start + size, PAGE_SIZE);
 	u32 num_pages = (end - start) / PAGE_SIZE;
 
+	/* identity mappings that land in the vmalloc arena stay there */
+	kernel_status_t status = vmap_reserve(start, end - start);
+	if (status != KERNEL_OK)
+		return status;
+
 	for (u32 i = 0; i < num_pages; i++) {
 		u32 va = start + i * PAGE_SIZE;
 		u32 pa = va;
 
 		u32 current_phys = vmm_get_physical_addr(va);
 		if (current_phys == 0) {
-			kernel_status_t status
-				= vmm_map_page(va, pa,
-					       PAGE_FLAG_PRESENT | PAGE_FLAG_RW
-						       | PAGE_FLAG_GLOBAL);
+			status = vmm_map_page(va, pa, PAGE_FLAGS_KERNEL);
 			if (status != KERNEL_OK)
 				return status;
 		} else if (current_phys != pa) {
@@ -337,31 +659,55 @@ kernel_status_t vmm_map_if_not_mapped(u32 phys_start, u32 size)
 	return KERNEL_OK;
 }
 
+void *vmm_map_temp(u32 phys)
+{
+	/* before paging is enabled every frame is reachable directly */
+	if (!is_paging_enabled())
+		return (void *)phys;
+
+	u32 pd_index = VMM_TEMP_MAP_ADDR >> 22;
+	u32 pt_index = (VMM_TEMP_MAP_ADDR >> 12) & 0x3FF;
+	u32 *pt = (u32 *)(PAGE_RECURSIVE_PT_BASE + (pd_index << 12));
+	pt[pt_index] = (phys & ~0xFFF) | PAGE_FLAG_PRESENT | PAGE_FLAG_RW;
+	tlb_invlpg(VMM_TEMP_MAP_ADDR);
+	return (void *)VMM_TEMP_MAP_ADDR;
+}
+
+void vmm_unmap_temp(void)
+{
+	if (!is_paging_enabled())
+		return;
+
+	u32 pd_index = VMM_TEMP_MAP_ADDR >> 22;
+	u32 pt_index = (VMM_TEMP_MAP_ADDR >> 12) & 0x3FF;
+	u32 *pt = (u32 *)(PAGE_RECURSIVE_PT_BASE + (pd_index << 12));
+	pt[pt_index] = 0;
+	tlb_invlpg(VMM_TEMP_MAP_ADDR);
+}
+
 u32 vmm_get_physical_addr(u32 virt_addr)
 {
 	u32 pd_index = virt_addr >> 22;
 	u32 pt_index = (virt_addr >> 12) & 0x3FF;
+	u32 *pd = vmm_pd();
 
-	if (is_paging_enabled()) {
-		u32 *pd = (u32 *)PAGE_RECURSIVE_PD;
-		if (!(pd[pd_index] & PAGE_FLAG_PRESENT)) {
-			return 0;
-		}
-		u32 *pt = (u32 *)(PAGE_RECURSIVE_PT_BASE + (pd_index << 12));
-		if (!(pt[pt_index] & PAGE_FLAG_PRESENT)) {
-			return 0;
-		}
-		return (pt[pt_index] & ~0xFFF) | (virt_addr & 0xFFF);
-	} else {
-		if (!(kernel_page_directory[pd_index] & PAGE_FLAG_PRESENT)) {
-			return 0;
-		}
-		u32 *pt = (u32 *)(kernel_page_directory[pd_index] & ~0xFFF);
-		if (!(pt[pt_index] & PAGE_FLAG_PRESENT)) {
-			return 0;
-		}
-		return (pt[pt_index] & ~0xFFF) | (virt_addr & 0xFFF);
+	if (!(pd[pd_index] & PAGE_FLAG_PRESENT)) {
+		return 0;
 	}
+	if (pd[pd_index] & PAGE_FLAG_LARGE) {
+		return (pd[pd_index] & LARGE_PAGE_MASK)
+		       | (virt_addr & ~LARGE_PAGE_MASK);
+	}
+	u32 *pt = vmm_pt(pd_index);
+	if (!(pt[pt_index] & PAGE_FLAG_PRESENT)) {
+		return 0;
+	}
+	return (pt[pt_index] & ~0xFFF) | (virt_addr & 0xFFF);
+}
+
+bool vmm_pde_present(u32 virt_addr)
+{
+	return (vmm_pd()[virt_addr >> 22] & PAGE_FLAG_PRESENT) != 0;
 }
 
 void vmm_switch_directory(page_directory_t *dir)
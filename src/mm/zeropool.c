@@ -0,0 +1,80 @@
+#include <kernel/kernel.h>
+#include <mm/bitmap.h>
+#include <mm/buddy.h>
+#include <mm/vmm.h>
+#include <string.h>
+
+/*
+ * Pre-zeroed page pool.
+ *
+ * kernel_idle() tops the pool up with cleared frames so that page table
+ * creation, new slabs and anonymous memory get a zeroed frame without
+ * clearing 4 KiB on the allocation path. The pool hands out frames from the
+ * PMM_ZONE_HIGH fallback order; a request whose zone flags do not accept
+ * the frame on top of the pool is served inline instead.
+ *
+ * Frames are cleared through the single VMM temporary mapping slot, so
+ * neither function may be called from interrupt context.
+ */
+#define ZERO_POOL_SIZE 64
+
+static u32 zero_pool[ZERO_POOL_SIZE];
+static zero_pool_stats_t zero_stats = {.capacity = ZERO_POOL_SIZE};
+
+static void zero_frame(u32 phys)
+{
+	void *va = vmm_map_temp(phys);
+	memset(va, 0, PAGE_SIZE);
+	vmm_unmap_temp();
+}
+
+/* Return true if a frame at phys satisfies the zone flags of a request */
+static bool zero_pool_zone_ok(u32 phys, u32 flags)
+{
+	u32 pfn = phys >> PAGE_SHIFT;
+	if (flags & PMM_ZONE_DMA)
+		return pfn < ZONE_DMA_END_PFN;
+	if (flags & PMM_ZONE_HIGH)
+		return true;
+	return pfn < ZONE_NORMAL_END_PFN;
+}
+
+u32 pmm_alloc_zeroed_page(u32 flags)
+{
+	if (zero_stats.count > 0) {
+		u32 phys = zero_pool[zero_stats.count - 1];
+		if (zero_pool_zone_ok(phys, flags)) {
+			zero_stats.count--;
+			zero_stats.hits++;
+			return phys;
+		}
+	}
+
+	zero_stats.misses++;
+	u32 phys = pmm_alloc_page(flags);
+	if (phys)
+		zero_frame(phys);
+	return phys;
+}
+
+void pmm_zero_pool_refill(u32 budget)
+{
+	/* pooled frames are out of reach of reclaim, so the pool is only
+	 * topped up while memory is plentiful
+	 */
+	while (budget-- > 0 && zero_stats.count < ZERO_POOL_SIZE
+	       && pmm_get_free_pages() > g_physical_allocator.wmark_high) {
+		u32 phys = pmm_alloc_page(PMM_ZONE_HIGH);
+		if (!phys)
+			return;
+		zero_frame(phys);
+		zero_pool[zero_stats.count++] = phys;
+		zero_stats.refilled++;
+	}
+}
+
+void pmm_zero_pool_stats(zero_pool_stats_t *stats)
+{
+	if (stats)
+		*stats = zero_stats;
+}